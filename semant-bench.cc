@@ -0,0 +1,681 @@
+/*
+ * semant-bench.cc - 语义分析器基准测试
+ *
+ * 用法：
+ *   ./lexer good.cl | ./parser | ./semant-bench [轮数]
+ *       表达式分派微基准：读入语法分析器输出的AST，收集所有表达式节点，
+ *       分别用原先type_check_expression中的dynamic_cast级联和expr_kind
+ *       查表对每个节点分类，输出两种方式每秒处理的节点数。
+ *       测试用例中的每个程序（good.cl、stack.cl等）需要单独运行。
+ *
+ *   ./semant-bench suite [-j N] [--sizes 100,1000,10000] [--workload NAME] > result.json
+ *       用生成器直接构造各种形状的程序（不经过词法和语法分析），每个用例
+ *       在单独的子进程中检查，以便分别测量峰值内存。每个用例输出一行JSON：
+ *       各阶段的耗时和堆增长、检查的表达式节点数、吞吐量和峰值RSS。
+ *       检查的节点数与生成的节点数不同时用例失败。
+ *       NAME为deep_chain、wide、dispatch_dense、nested_let_if、huge_block之一。
+ *
+ *   ./semant-bench compare old.json new.json
+ *       比较两个构建的suite结果，输出每个用例的耗时和峰值内存之比。
+ *
+ *   ./semant-bench batch [-j N] [--size N] [--copies K]
+ *       每种形状生成K个互不共用节点的程序，用semant_batch以N个线程同时
+ *       检查，要求全部通过，且同一形状的各个程序输出的带类型AST相同。
+ *       用-fsanitize=thread编译后运行，检查并发检查的程序之间（例如共用的
+ *       基本类节点上）没有数据竞争。
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "cool-tree.h"
+#include "semant.h"
+
+extern Program ast_root;
+extern int ast_yyparse(void);
+
+//////////////////////////////////////////////////////////////////////
+// 原先的分派方式：按type_check_expression中的顺序依次dynamic_cast
+//////////////////////////////////////////////////////////////////////
+
+static ExprKind classify_by_cast(Expression expr)
+{
+    if (dynamic_cast<int_const_class*>(expr) != NULL) return EXPR_INT_CONST;
+    else if (dynamic_cast<bool_const_class*>(expr) != NULL) return EXPR_BOOL_CONST;
+    else if (dynamic_cast<string_const_class*>(expr) != NULL) return EXPR_STRING_CONST;
+    else if (dynamic_cast<object_class*>(expr) != NULL) return EXPR_OBJECT;
+    else if (dynamic_cast<assign_class*>(expr) != NULL) return EXPR_ASSIGN;
+    else if (dynamic_cast<dispatch_class*>(expr) != NULL) return EXPR_DISPATCH;
+    else if (dynamic_cast<static_dispatch_class*>(expr) != NULL) return EXPR_STATIC_DISPATCH;
+    else if (dynamic_cast<cond_class*>(expr) != NULL) return EXPR_COND;
+    else if (dynamic_cast<loop_class*>(expr) != NULL) return EXPR_LOOP;
+    else if (dynamic_cast<block_class*>(expr) != NULL) return EXPR_BLOCK;
+    else if (dynamic_cast<let_class*>(expr) != NULL) return EXPR_LET;
+    else if (dynamic_cast<plus_class*>(expr) != NULL) return EXPR_PLUS;
+    else if (dynamic_cast<eq_class*>(expr) != NULL) return EXPR_EQ;
+    else if (dynamic_cast<new__class*>(expr) != NULL) return EXPR_NEW;
+    else if (dynamic_cast<isvoid_class*>(expr) != NULL) return EXPR_ISVOID;
+    return EXPR_NO_EXPR;
+}
+
+//////////////////////////////////////////////////////////////////////
+// 计时
+//////////////////////////////////////////////////////////////////////
+
+template <class Classify>
+static double time_classify(const std::vector<Expression>& nodes, int rounds, Classify classify)
+{
+    volatile int sink = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int r = 0; r < rounds; r++)
+    {
+        for (size_t i = 0; i < nodes.size(); i++)
+        {
+            sink += classify(nodes[i]);
+        }
+    }
+    std::chrono::steady_clock::time_point stop = std::chrono::steady_clock::now();
+    return std::chrono::duration<double>(stop - start).count();
+}
+
+static void report(const char* name, double seconds, double total_nodes)
+{
+    cout << name << ": " << (seconds * 1e9 / total_nodes) << " ns/node, "
+         << (total_nodes / seconds) << " nodes/s" << endl;
+}
+
+static int dispatch_bench(int rounds)
+{
+    ast_yyparse();
+
+    // 收集所有属性初始化和方法体中的表达式
+    std::vector<Expression> nodes;
+    Classes classes = ((program_class*)ast_root)->get_classes();
+    for(int i = classes->first(); classes->more(i); i = classes->next(i))
+    {
+        Features features = classes->nth(i)->get_features();
+        for(int j = features->first(); features->more(j); j = features->next(j))
+        {
+            Feature f = features->nth(j);
+            if (dynamic_cast<attr_class*>(f) != NULL)
+                collect_expressions(((attr_class*)f)->get_init(), nodes);
+            else if (dynamic_cast<method_class*>(f) != NULL)
+                collect_expressions(((method_class*)f)->get_expr(), nodes);
+        }
+    }
+
+    if (nodes.empty())
+    {
+        cerr << "semant-bench: 输入中没有表达式" << endl;
+        return 1;
+    }
+
+    double total_nodes = (double)nodes.size() * rounds;
+    cout << "nodes: " << nodes.size() << ", rounds: " << rounds << endl;
+
+    report("dynamic_cast cascade (before)", time_classify(nodes, rounds, classify_by_cast), total_nodes);
+    report("expr_kind switch (after)     ", time_classify(nodes, rounds, expr_kind), total_nodes);
+
+    return 0;
+}
+
+//////////////////////////////////////////////////////////////////////
+// 程序生成器
+//
+// 每种形状按规模n生成一个没有语义错误的程序。列表都用append逐个
+// 连接，与语法分析器构造的AST形状相同。
+//////////////////////////////////////////////////////////////////////
+
+static Symbol bench_filename;
+
+static Symbol name(const char* text)
+{
+    return idtable.add_string((char*)text);
+}
+
+static Symbol name(const char* prefix, int n)
+{
+    char buffer[64];
+    snprintf(buffer, sizeof(buffer), "%s%d", prefix, n);
+    return idtable.add_string(buffer);
+}
+
+static Expression int_value(int n)
+{
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%d", n);
+    return int_const(inttable.add_string(buffer));
+}
+
+static Expressions one_actual(Expression e)
+{
+    return single_Expressions(e);
+}
+
+static Formals one_formal(Symbol formal_name, Symbol type)
+{
+    return single_Formals(formal(formal_name, type));
+}
+
+static Features add_feature(Features features, Feature f)
+{
+    return append_Features(features, single_Features(f));
+}
+
+static Expressions add_expression(Expressions expressions, Expression e)
+{
+    return append_Expressions(expressions, single_Expressions(e));
+}
+
+static Classes add_class(Classes classes, Symbol class_name, Symbol parent, Features features)
+{
+    return append_Classes(classes, single_Classes(class_(class_name, parent, features, bench_filename)));
+}
+
+// 加上Main类：main() : Object { 0 }
+static Classes add_main(Classes classes, Features features)
+{
+    features = add_feature(features, method(name("main"), nil_Formals(), name("Object"), int_value(0)));
+    return add_class(classes, name("Main"), name("Object"), features);
+}
+
+// n层的继承链：每层重写f，用if求本类和根类的LUB，并分派到自己的f
+static Classes deep_chain(int n)
+{
+    Classes classes = nil_Classes();
+    for (int i = 0; i < n; i++)
+    {
+        Symbol class_name = name("C", i);
+        Features features = nil_Features();
+        features = add_feature(features, attr(name("a", i), name("Int"), int_value(i)));
+        features = add_feature(features, method(name("f"), one_formal(name("x"), name("Int")), name("Int"),
+            plus(object(name("x")), object(name("a", i)))));
+        features = add_feature(features, method(name("k", i), nil_Formals(), name("C", 0),
+            cond(eq(object(name("a", i)), int_value(0)), new_(class_name), new_(name("C", 0)))));
+        features = add_feature(features, method(name("h", i), nil_Formals(), name("Int"),
+            dispatch(new_(class_name), name("f"), one_actual(object(name("a", i))))));
+        classes = add_class(classes, class_name, i == 0 ? name("Object") : name("C", i - 1), features);
+    }
+    return add_main(classes, nil_Features());
+}
+
+// 一个基类和n个直接子类：每个子类重写f，Main用if求相邻兄弟类的LUB再分派
+static Classes wide(int n)
+{
+    Classes classes = nil_Classes();
+    Features base = nil_Features();
+    base = add_feature(base, method(name("f"), one_formal(name("x"), name("Int")), name("Int"), object(name("x"))));
+    classes = add_class(classes, name("Base"), name("Object"), base);
+
+    Expressions body = nil_Expressions();
+    for (int i = 0; i < n; i++)
+    {
+        Features features = nil_Features();
+        features = add_feature(features, method(name("f"), one_formal(name("x"), name("Int")), name("Int"),
+            plus(object(name("x")), int_value(i))));
+        classes = add_class(classes, name("W", i), name("Base"), features);
+
+        if (i > 0)
+        {
+            body = add_expression(body,
+                dispatch(cond(bool_const(true), new_(name("W", i - 1)), new_(name("W", i))),
+                         name("f"), one_actual(int_value(i))));
+        }
+    }
+    body = add_expression(body, int_value(0));
+
+    Features main_features = nil_Features();
+    main_features = add_feature(main_features, method(name("pick"), nil_Formals(), name("Int"), block(body)));
+    return add_main(classes, main_features);
+}
+
+// 一个有10个方法的Helper类，Main中共n次分派（两两嵌套），每个方法体最多100次
+static Classes dispatch_dense(int n)
+{
+    const int METHODS = 10;
+    Classes classes = nil_Classes();
+    Features helper = nil_Features();
+    for (int m = 0; m < METHODS; m++)
+    {
+        helper = add_feature(helper, method(name("m", m), one_formal(name("x"), name("Int")), name("Int"),
+            plus(object(name("x")), int_value(m))));
+    }
+    classes = add_class(classes, name("Helper"), name("Object"), helper);
+
+    Features main_features = nil_Features();
+    main_features = add_feature(main_features, attr(name("h"), name("Helper"), new_(name("Helper"))));
+    for (int done = 0, k = 0; done < n; k++)
+    {
+        Expressions body = nil_Expressions();
+        for (int i = 0; i < 50 && done < n; i++, done += 2)
+        {
+            Expression inner = dispatch(object(name("h")), name("m", (i + 1) % METHODS), one_actual(int_value(i)));
+            body = add_expression(body, dispatch(object(name("h")), name("m", i % METHODS), one_actual(inner)));
+        }
+        main_features = add_feature(main_features, method(name("d", k), nil_Formals(), name("Int"), block(body)));
+    }
+    return add_main(classes, main_features);
+}
+
+// 一个方法体：n层交替嵌套的let和if
+static Classes nested_let_if(int n)
+{
+    Expression body = int_value(0);
+    for (int i = n - 1; i >= 0; i--)
+    {
+        Symbol variable = name("v", i);
+        body = let(variable, name("Int"), int_value(i),
+                   cond(eq(object(variable), int_value(i)), body, object(variable)));
+    }
+
+    Features main_features = nil_Features();
+    main_features = add_feature(main_features, method(name("nest"), nil_Formals(), name("Int"), body));
+    return add_main(nil_Classes(), main_features);
+}
+
+// 一个有n个表达式的块：赋值、分派和比较交替出现
+static Classes huge_block(int n)
+{
+    Expressions body = nil_Expressions();
+    for (int i = 0; i < n; i++)
+    {
+        Expression e;
+        switch (i % 3)
+        {
+        case 0:  e = assign(name("x"), plus(object(name("x")), int_value(i))); break;
+        case 1:  e = dispatch(object(name("self")), name("step"), one_actual(object(name("x")))); break;
+        default: e = eq(object(name("x")), int_value(i)); break;
+        }
+        body = add_expression(body, e);
+    }
+    body = add_expression(body, object(name("x")));
+
+    Features main_features = nil_Features();
+    main_features = add_feature(main_features, attr(name("x"), name("Int"), int_value(0)));
+    main_features = add_feature(main_features, method(name("step"), one_formal(name("y"), name("Int")), name("Int"),
+        plus(object(name("y")), int_value(1))));
+    main_features = add_feature(main_features, method(name("run"), nil_Formals(), name("Int"), block(body)));
+    return add_main(nil_Classes(), main_features);
+}
+
+// 与AST读入器一样把每个表达式的类型设为_no_type（类型为NULL的初始化
+// 表达式会被当作没有初始化），返回表达式节点数
+static uint64_t mark_untyped(Classes classes)
+{
+    Symbol no_type = name("_no_type");
+    std::vector<Class_> class_list;
+    flatten_list(classes, class_list);
+
+    std::vector<Feature> features;
+    std::vector<Expression> nodes;
+    for (size_t i = 0; i < class_list.size(); i++)
+    {
+        features.clear();
+        flatten_list(class_list[i]->get_features(), features);
+        for (size_t j = 0; j < features.size(); j++)
+        {
+            if (dynamic_cast<attr_class*>(features[j]) != NULL)
+                collect_expressions(((attr_class*)features[j])->get_init(), nodes);
+            else
+                collect_expressions(((method_class*)features[j])->get_expr(), nodes);
+        }
+    }
+
+    for (size_t k = 0; k < nodes.size(); k++)
+    {
+        nodes[k]->set_type(no_type);
+    }
+    return nodes.size();
+}
+
+struct Workload {
+    const char* name;
+    Classes (*generate)(int n);
+};
+
+static const Workload WORKLOADS[] = {
+    { "deep_chain",     deep_chain },
+    { "wide",           wide },
+    { "dispatch_dense", dispatch_dense },
+    { "nested_let_if",  nested_let_if },
+    { "huge_block",     huge_block },
+};
+
+static const int WORKLOAD_COUNT = sizeof(WORKLOADS) / sizeof(WORKLOADS[0]);
+
+//////////////////////////////////////////////////////////////////////
+// 基准套件
+//////////////////////////////////////////////////////////////////////
+
+// 在子进程中生成并检查一个程序，把一行JSON结果写到fd
+static void run_case(const Workload& workload, int size, int fd)
+{
+    bench_filename = stringtable.add_string((char*)"<bench>");
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    Classes classes = workload.generate(size);
+    uint64_t generated = mark_untyped(classes);
+    double generate_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    SemantStats stats;
+    std::ostringstream diagnostics;
+    semant_check(classes, diagnostics, semant_jobs, &stats);
+
+    double total_seconds = 0;
+    for (size_t i = 0; i < stats.phases.size(); i++)
+    {
+        total_seconds += stats.phases[i].seconds;
+    }
+    uint64_t nodes = stats.counters.expressions_checked;
+
+    // 生成的程序没有空表达式，每个节点都应该恰好检查一次
+    if (nodes != generated)
+    {
+        cerr << "semant-bench: " << workload.name << "/" << size << ": checked " << nodes
+             << " expressions, generated " << generated << endl;
+        _exit(1);
+    }
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    std::ostringstream json;
+    json << "{\"workload\": \"" << workload.name << "\", \"size\": " << size
+         << ", \"jobs\": " << semant_jobs << ", \"status\": \"ok\", \"errors\": " << stats.errors
+         << ", \"nodes\": " << nodes
+         << ", \"generate_seconds\": " << generate_seconds
+         << ", \"total_seconds\": " << total_seconds
+         << ", \"nodes_per_second\": " << (total_seconds > 0 ? nodes / total_seconds : 0)
+         << ", \"peak_rss_kb\": " << usage.ru_maxrss
+         << ", \"phases\": {";
+    for (size_t i = 0; i < stats.phases.size(); i++)
+    {
+        json << (i ? ", " : "") << "\"" << stats.phases[i].name << "\": {\"seconds\": "
+             << stats.phases[i].seconds << ", \"heap_bytes\": " << stats.phases[i].heap_bytes << "}";
+    }
+    json << "}}\n";
+
+    std::string line = json.str();
+    if (write(fd, line.data(), line.size()) != (ssize_t)line.size())
+    {
+        _exit(1);
+    }
+}
+
+// 在子进程中运行一个用例，返回它输出的一行；子进程异常退出时返回空串
+static std::string fork_case(const Workload& workload, int size, int* status)
+{
+    int pipe_fds[2];
+    if (pipe(pipe_fds) != 0)
+    {
+        perror("semant-bench: pipe");
+        exit(1);
+    }
+
+    pid_t child = fork();
+    if (child == 0)
+    {
+        close(pipe_fds[0]);
+        run_case(workload, size, pipe_fds[1]);
+        _exit(0);
+    }
+    close(pipe_fds[1]);
+
+    std::string line;
+    char buffer[4096];
+    ssize_t n;
+    while ((n = read(pipe_fds[0], buffer, sizeof(buffer))) > 0)
+    {
+        line.append(buffer, n);
+    }
+    close(pipe_fds[0]);
+
+    waitpid(child, status, 0);
+    if (!WIFEXITED(*status) || WEXITSTATUS(*status) != 0) return "";
+    return line;
+}
+
+static int suite(int argc, char *argv[])
+{
+    std::vector<int> sizes;
+    const char* only = NULL;
+    for (int i = 0; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--sizes") == 0 && i + 1 < argc)
+        {
+            std::stringstream list(argv[++i]);
+            std::string item;
+            while (std::getline(list, item, ','))
+            {
+                sizes.push_back(atoi(item.c_str()));
+            }
+        }
+        else if (strcmp(argv[i], "--workload") == 0 && i + 1 < argc)
+        {
+            only = argv[++i];
+        }
+        else
+        {
+            cerr << "usage: semant-bench suite [-j N] [--sizes N,N,...] [--workload NAME]" << endl;
+            return 1;
+        }
+    }
+    if (sizes.empty())
+    {
+        sizes.push_back(100);
+        sizes.push_back(1000);
+        sizes.push_back(10000);
+    }
+
+    int failed = 0;
+    for (int w = 0; w < WORKLOAD_COUNT; w++)
+    {
+        if (only != NULL && strcmp(only, WORKLOADS[w].name) != 0) continue;
+        for (size_t k = 0; k < sizes.size(); k++)
+        {
+            // 每个用例一个子进程，峰值RSS互不影响
+            cout.flush();
+            int status = 0;
+            std::string line = fork_case(WORKLOADS[w], sizes[k], &status);
+            if (!line.empty())
+            {
+                cout << line;
+            }
+            else
+            {
+                // 例如递归过深导致栈溢出
+                failed++;
+                cout << "{\"workload\": \"" << WORKLOADS[w].name << "\", \"size\": " << sizes[k]
+                     << ", \"jobs\": " << semant_jobs << ", \"status\": \"failed\", \"signal\": "
+                     << (WIFSIGNALED(status) ? WTERMSIG(status) : 0) << "}\n";
+            }
+            cout.flush();
+        }
+    }
+    return failed ? 1 : 0;
+}
+
+//////////////////////////////////////////////////////////////////////
+// 并发批量检查
+//////////////////////////////////////////////////////////////////////
+
+static int batch(int argc, char *argv[])
+{
+    int size = 100;
+    int copies = 4;
+    for (int i = 0; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--size") == 0 && i + 1 < argc)
+        {
+            size = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--copies") == 0 && i + 1 < argc)
+        {
+            copies = atoi(argv[++i]);
+        }
+        else
+        {
+            cerr << "usage: semant-bench batch [-j N] [--size N] [--copies K]" << endl;
+            return 1;
+        }
+    }
+
+    // 各形状的程序交错排列，使同时检查的程序形状不同
+    bench_filename = stringtable.add_string((char*)"<bench>");
+    std::vector<Classes> programs;
+    for (int k = 0; k < copies; k++)
+    {
+        for (int w = 0; w < WORKLOAD_COUNT; w++)
+        {
+            Classes classes = WORKLOADS[w].generate(size);
+            mark_untyped(classes);
+            programs.push_back(classes);
+        }
+    }
+
+    std::vector<ProgramVerdict> verdicts;
+    semant_batch(programs, verdicts);
+
+    int failed = 0;
+    std::vector<std::string> expected(WORKLOAD_COUNT);
+    for (size_t k = 0; k < programs.size(); k++)
+    {
+        const char* workload = WORKLOADS[k % WORKLOAD_COUNT].name;
+        if (verdicts[k].errors)
+        {
+            failed++;
+            cerr << "semant-bench: " << workload << " copy " << k / WORKLOAD_COUNT << ": "
+                 << verdicts[k].errors << " errors" << endl << verdicts[k].diagnostics;
+            continue;
+        }
+
+        std::string typed_ast;
+        TypedAstWriter writer;
+        writer.write(program(programs[k]));
+        writer.append_to(typed_ast);
+
+        std::string& first = expected[k % WORKLOAD_COUNT];
+        if (first.empty())
+        {
+            first.swap(typed_ast);
+        }
+        else if (typed_ast != first)
+        {
+            failed++;
+            cerr << "semant-bench: " << workload << " copy " << k / WORKLOAD_COUNT
+                 << ": typed AST differs from copy 0" << endl;
+        }
+    }
+
+    cout << programs.size() << " programs, " << failed << " failed" << endl;
+    return failed ? 1 : 0;
+}
+
+//////////////////////////////////////////////////////////////////////
+// 比较两个构建的结果
+//////////////////////////////////////////////////////////////////////
+
+// 从suite输出的一行中取出顶层字段的值（字符串去掉引号），没有时返回空串
+static std::string json_field(const std::string& line, const char* key)
+{
+    std::string pattern = std::string("\"") + key + "\": ";
+    size_t pos = line.find(pattern);
+    if (pos == std::string::npos) return "";
+    pos += pattern.size();
+    if (line[pos] == '"')
+    {
+        size_t end = line.find('"', pos + 1);
+        return line.substr(pos + 1, end - pos - 1);
+    }
+    size_t end = line.find_first_of(",}", pos);
+    return line.substr(pos, end - pos);
+}
+
+// 读入一个结果文件，按"workload/size"索引，order记录第一次出现的顺序
+static bool load_results(const char* path, std::map<std::string, std::string>& results,
+                         std::vector<std::string>& order)
+{
+    std::ifstream in(path);
+    if (!in)
+    {
+        cerr << "semant-bench: cannot read " << path << endl;
+        return false;
+    }
+    std::string line;
+    while (std::getline(in, line))
+    {
+        if (line.empty()) continue;
+        std::string key = json_field(line, "workload") + "/" + json_field(line, "size");
+        if (results.find(key) == results.end()) order.push_back(key);
+        results[key] = line;
+    }
+    return true;
+}
+
+static int compare(const char* old_path, const char* new_path)
+{
+    std::map<std::string, std::string> old_results, new_results;
+    std::vector<std::string> order, new_order;
+    if (!load_results(old_path, old_results, order) || !load_results(new_path, new_results, new_order))
+    {
+        return 1;
+    }
+
+    printf("%-24s %12s %12s %8s %12s %12s %8s\n",
+           "case", "old s", "new s", "speedup", "old rss kb", "new rss kb", "rss");
+    for (size_t i = 0; i < order.size(); i++)
+    {
+        std::map<std::string, std::string>::const_iterator it = new_results.find(order[i]);
+        if (it == new_results.end()) continue;
+        const std::string& before = old_results[order[i]];
+        const std::string& after = it->second;
+        if (json_field(before, "status") != "ok" || json_field(after, "status") != "ok")
+        {
+            printf("%-24s %s -> %s\n", order[i].c_str(),
+                   json_field(before, "status").c_str(), json_field(after, "status").c_str());
+            continue;
+        }
+
+        double old_seconds = atof(json_field(before, "total_seconds").c_str());
+        double new_seconds = atof(json_field(after, "total_seconds").c_str());
+        double old_rss = atof(json_field(before, "peak_rss_kb").c_str());
+        double new_rss = atof(json_field(after, "peak_rss_kb").c_str());
+        printf("%-24s %12.6f %12.6f %7.2fx %12.0f %12.0f %7.2fx\n", order[i].c_str(),
+               old_seconds, new_seconds, new_seconds > 0 ? old_seconds / new_seconds : 0.0,
+               old_rss, new_rss, old_rss > 0 ? new_rss / old_rss : 0.0);
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    handle_semant_flags(&argc, argv);
+
+    if (argc > 1 && strcmp(argv[1], "suite") == 0)
+    {
+        return suite(argc - 2, argv + 2);
+    }
+    if (argc > 1 && strcmp(argv[1], "batch") == 0)
+    {
+        return batch(argc - 2, argv + 2);
+    }
+    if (argc > 1 && strcmp(argv[1], "compare") == 0)
+    {
+        if (argc != 4)
+        {
+            cerr << "usage: semant-bench compare old.json new.json" << endl;
+            return 1;
+        }
+        return compare(argv[2], argv[3]);
+    }
+    return dispatch_bench(argc > 1 ? atoi(argv[1]) : 1000);
+}
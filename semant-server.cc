@@ -0,0 +1,305 @@
+/*
+ * semant-server.cc - 常驻的语义分析服务
+ *
+ * 用法：./semant-server [-j N] [--incremental] [--class-cache FILE]
+ *           从标准输入读请求，结果写到标准输出
+ *       ./semant-server --socket PATH [...]
+ *           在Unix域套接字PATH上依次接受连接，每个连接上可以发送多个请求
+ *       ./semant-server --batch [-j N] [...]
+ *           批量模式：从标准输入读入全部请求，用N个线程同时检查不同的程序，
+ *           按请求的顺序回复，最后在标准错误输出通过和失败的程序数
+ *
+ * 每个请求是一帧：4字节大端长度，然后是语法分析器输出的AST文本。
+ * 对每个请求回复4字节大端状态（0通过，1有语义错误，2 AST无法解析），
+ * 然后是两帧：错误输出（与semant写到标准错误的内容相同）和带类型的AST
+ * （只在通过时非空，与semant写到标准输出的内容相同）。
+ *
+ * 每个请求的类表在处理完后释放；符号表、基本类和增量检查的类摘要
+ * 在请求之间保留，不再为每个程序重新建立。
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <sstream>
+#include <vector>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "cool-tree.h"
+#include "semant.h"
+
+extern Program ast_root;
+extern int ast_yyparse(void);
+extern FILE *ast_yyin;
+extern void ast_yyrestart(FILE *input_file);
+
+// 单个请求的长度上限，超过时认为数据流已经错乱
+static const uint32_t MAX_FRAME = 256u << 20;
+
+enum ReplyStatus {
+    REPLY_OK           = 0,
+    REPLY_SEMANT_ERROR = 1,
+    REPLY_PARSE_ERROR  = 2
+};
+
+//////////////////////////////////////////////////////////////////////
+// 帧的读写
+//////////////////////////////////////////////////////////////////////
+
+static bool read_full(int fd, char* buffer, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t n = read(fd, buffer, size);
+        if (n <= 0) return false;
+        buffer += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool write_full(int fd, const char* buffer, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t n = write(fd, buffer, size);
+        if (n <= 0) return false;
+        buffer += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool read_u32(int fd, uint32_t* value)
+{
+    unsigned char bytes[4];
+    if (!read_full(fd, (char*)bytes, 4)) return false;
+    *value = ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16) |
+             ((uint32_t)bytes[2] << 8) | (uint32_t)bytes[3];
+    return true;
+}
+
+static bool write_u32(int fd, uint32_t value)
+{
+    unsigned char bytes[4] = {
+        (unsigned char)(value >> 24), (unsigned char)(value >> 16),
+        (unsigned char)(value >> 8), (unsigned char)value
+    };
+    return write_full(fd, (const char*)bytes, 4);
+}
+
+static bool write_frame(int fd, const std::string& payload)
+{
+    return write_u32(fd, payload.size()) && write_full(fd, payload.data(), payload.size());
+}
+
+//////////////////////////////////////////////////////////////////////
+// 处理一个请求
+//////////////////////////////////////////////////////////////////////
+
+// 解析一个请求中的AST，失败返回NULL
+static program_class* parse_request(std::string& source)
+{
+    // 让AST词法分析器从内存中的请求读入
+    FILE* input = fmemopen(&source[0], source.size(), "r");
+    if (input == NULL) return NULL;
+    ast_yyin = input;
+    ast_yyrestart(input);
+    ast_root = NULL;
+    int parse_result = ast_yyparse();
+    fclose(input);
+
+    if (parse_result != 0) return NULL;
+    return (program_class*)ast_root;
+}
+
+// 按检查结果回复一个请求；program为NULL表示AST无法解析。checked是检查
+// program时保留的结果，可以为NULL
+static bool write_reply(int fd, program_class* program, int errors, const std::string& diagnostics,
+                        const CheckedProgram* checked)
+{
+    ReplyStatus status;
+    std::string message;
+    TypedAstWriter typed_ast;
+    if (program == NULL)
+    {
+        status = REPLY_PARSE_ERROR;
+        message = "semant-server: cannot parse AST\n";
+    }
+    else if (errors)
+    {
+        status = REPLY_SEMANT_ERROR;
+        message = diagnostics;
+        if (!semant_diagnostics_json)
+        {
+            message += "Compilation halted due to static semantic errors.\n";
+        }
+    }
+    else
+    {
+        typed_ast.write(program, checked);
+        status = REPLY_OK;
+        message = diagnostics;
+    }
+
+    // 带类型的AST直接从输出缓冲区写出，不再复制
+    return write_u32(fd, status) && write_frame(fd, message) &&
+           write_u32(fd, typed_ast.size()) && typed_ast.flush(fd);
+}
+
+// 读入一个请求，没有更多请求或数据流错乱时返回false
+static bool read_request(int fd, std::string& source)
+{
+    uint32_t size;
+    if (!read_u32(fd, &size)) return false;
+    if (size > MAX_FRAME)
+    {
+        cerr << "semant-server: request of " << size << " bytes is too large" << endl;
+        return false;
+    }
+
+    source.resize(size);
+    if (size > 0 && !read_full(fd, &source[0], size))
+    {
+        cerr << "semant-server: truncated request" << endl;
+        return false;
+    }
+    return true;
+}
+
+// 依次处理一个数据流上的所有请求，直到对方关闭
+static bool serve(int in_fd, int out_fd)
+{
+    std::string source;
+    while (read_request(in_fd, source))
+    {
+        program_class* program = parse_request(source);
+        int errors = 0;
+        std::ostringstream diagnostics;
+        CheckedProgram checked;
+        if (program != NULL)
+        {
+            errors = semant_check(program->get_classes(), diagnostics, semant_jobs, NULL, &checked);
+        }
+        if (!write_reply(out_fd, program, errors, diagnostics.str(), &checked))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// 批量模式：读入全部请求后用semant_batch同时检查，再按顺序回复
+static bool serve_batch(int in_fd, int out_fd)
+{
+    std::vector<program_class*> programs;
+    std::vector<Classes> parsed;
+    std::string source;
+    while (read_request(in_fd, source))
+    {
+        program_class* program = parse_request(source);
+        programs.push_back(program);
+        if (program != NULL)
+        {
+            parsed.push_back(program->get_classes());
+        }
+    }
+
+    std::vector<ProgramVerdict> verdicts;
+    semant_batch(parsed, verdicts);
+
+    int failed = 0;
+    size_t next = 0;
+    for (size_t k = 0; k < programs.size(); k++)
+    {
+        if (programs[k] == NULL)
+        {
+            failed++;
+            if (!write_reply(out_fd, NULL, 0, "", NULL)) return false;
+            continue;
+        }
+
+        const ProgramVerdict& verdict = verdicts[next++];
+        if (verdict.errors) failed++;
+        if (!write_reply(out_fd, programs[k], verdict.errors, verdict.diagnostics, NULL)) return false;
+    }
+
+    cerr << "semant-server: " << programs.size() << " programs, " << failed << " failed" << endl;
+    return true;
+}
+
+static int serve_socket(const char* path)
+{
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0)
+    {
+        perror("semant-server: socket");
+        return 1;
+    }
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path))
+    {
+        cerr << "semant-server: socket path too long: " << path << endl;
+        return 1;
+    }
+    strcpy(address.sun_path, path);
+    unlink(path);
+
+    if (bind(listener, (struct sockaddr*)&address, sizeof(address)) < 0 || listen(listener, 16) < 0)
+    {
+        perror("semant-server: bind");
+        return 1;
+    }
+
+    // 依次处理每个连接
+    for (;;)
+    {
+        int connection = accept(listener, NULL, NULL);
+        if (connection < 0)
+        {
+            perror("semant-server: accept");
+            continue;
+        }
+        serve(connection, connection);
+        close(connection);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    handle_semant_flags(&argc, argv);
+
+    const char* socket_path = NULL;
+    bool batch = false;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--socket") == 0 && i + 1 < argc)
+        {
+            socket_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--batch") == 0)
+        {
+            batch = true;
+        }
+        else
+        {
+            cerr << "usage: semant-server [-j N] [--incremental] [--class-cache FILE] [--diagnostics-json] [--socket PATH | --batch]" << endl;
+            return 1;
+        }
+    }
+
+    if (batch)
+    {
+        return serve_batch(0, 1) ? 0 : 1;
+    }
+    if (socket_path != NULL)
+    {
+        return serve_socket(socket_path);
+    }
+    return serve(0, 1) ? 0 : 1;
+}
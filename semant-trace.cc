@@ -0,0 +1,76 @@
+/*
+ * semant-trace.cc - 把跟踪文件转成文本
+ *
+ * 用法：./semant-trace semant.trace
+ *
+ * 跟踪文件由用-DSEMANT_TRACE编译的semant在 --trace FILE 时写出，
+ * 包含每个线程最近的事件。每个事件输出一行：
+ * 时间（微秒）、线程编号、事件种类和参数。
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include "semant.h"
+
+static const char* TRACE_KIND_NAMES[TRACE_KIND_COUNT] = {
+    "expr_begin",
+    "expr_end",
+    "dispatch",
+    "is_subtype",
+    "lub",
+    "find_method",
+    "find_signature"
+};
+
+static const char* symbol_at(const std::string& strings, uint32_t offset)
+{
+    if (offset == TRACE_NO_SYMBOL || offset >= strings.size()) return "-";
+    return strings.c_str() + offset;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2)
+    {
+        cerr << "usage: semant-trace FILE" << endl;
+        return 1;
+    }
+    
+    std::ifstream in(argv[1], std::ios::in | std::ios::binary);
+    std::stringstream buffer;
+    buffer << in.rdbuf();
+    std::string data = buffer.str();
+    
+    TraceFileHeader header;
+    if (data.size() < sizeof(header))
+    {
+        cerr << "semant-trace: " << argv[1] << ": not a trace file" << endl;
+        return 1;
+    }
+    memcpy(&header, data.data(), sizeof(header));
+    if (memcmp(header.magic, TRACE_FILE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != TRACE_FILE_VERSION ||
+        data.size() != sizeof(header) + header.event_count * sizeof(TraceFileEvent) + header.string_size)
+    {
+        cerr << "semant-trace: " << argv[1] << ": bad header" << endl;
+        return 1;
+    }
+    
+    const TraceFileEvent* events = (const TraceFileEvent*)(data.data() + sizeof(header));
+    std::string strings = data.substr(sizeof(header) + header.event_count * sizeof(TraceFileEvent));
+    
+    cout << header.event_count << " events, " << header.thread_count << " threads" << endl;
+    for (uint64_t i = 0; i < header.event_count; i++)
+    {
+        const TraceFileEvent& event = events[i];
+        const char* kind = event.kind < TRACE_KIND_COUNT ? TRACE_KIND_NAMES[event.kind] : "?";
+        char prefix[64];
+        snprintf(prefix, sizeof(prefix), "%14.3f T%-3u ", event.time / 1000.0, event.thread);
+        cout << prefix << kind << " " << event.value << " "
+             << symbol_at(strings, event.a) << " " << symbol_at(strings, event.b) << "\n";
+    }
+    return 0;
+}
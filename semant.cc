@@ -16,13 +16,50 @@
 #include <vector>
 #include <algorithm>
 #include <sstream>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <cctype>
+#include <climits>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <unistd.h>
 #include "cool-tree.h"
-#include "symtab.h"
 #include "semant.h"
 
 extern int semant_debug;
 extern char *curr_filename;
 
+// 类型检查使用的线程数，由-j N设置
+int semant_jobs = 1;
+
+// 增量检查，由--incremental设置
+bool semant_incremental = false;
+
+// 类摘要缓存文件，由--class-cache和--write-class-cache设置
+const char *semant_class_cache = NULL;
+const char *semant_write_class_cache = NULL;
+
+// 诊断信息的输出格式，由--diagnostics-json设置
+bool semant_diagnostics_json = false;
+
+// 错误数上限，由--max-errors设置，0表示不限
+int semant_max_errors = 0;
+
+// 跟踪文件，由--trace设置
+const char *semant_trace_file = NULL;
+
+// 统计文件，由--stats设置
+const char *semant_stats_file = NULL;
+
 //////////////////////////////////////////////////////////////////////
 // 符号定义
 //////////////////////////////////////////////////////////////////////
@@ -31,10 +68,13 @@ static Symbol
     Int,
     Float,
     String,
+    Str,
     Bool,
     Object,
+    IO,
     SELF_TYPE,
-    No_type;
+    No_type,
+    Err_type;
 
 static Symbol 
     arg,
@@ -60,19 +100,118 @@ static Symbol
     val,
     self;
 
+// 基本类的文件名
+static Symbol basic_class_filename;
+
+//////////////////////////////////////////////////////////////////////
+// 基本类表
+//
+// Object/IO/Int/Bool/String的父类、属性和方法签名在编译期给出。
+// 进程中第一次初始化时按表构造一次AST节点，之后每次分析都直接
+// 用add_class登记这些节点，与用户类走同一条路径。
+//////////////////////////////////////////////////////////////////////
+
+struct BasicFormal {
+    const char* name;
+    const char* type;
+};
+
+struct BasicFeature {
+    bool is_method;
+    const char* name;
+    const char* type;                      // 属性类型或方法返回类型
+    int formal_count;
+    BasicFormal formals[2];
+};
+
+struct BasicClass {
+    const char* name;
+    const char* parent;
+    unsigned char flags;
+    int feature_count;
+    BasicFeature features[5];
+};
+
+// 顺序决定类编号，Object必须在最前面（编号为0）
+static constexpr BasicClass BASIC_CLASSES[] = {
+    { "Object", "_no_class", CLASS_BASIC, 3, {
+        { true,  "abort",      "Object",     0, {} },
+        { true,  "type_name",  "String",     0, {} },
+        { true,  "copy",       "SELF_TYPE",  0, {} } } },
+    { "IO", "Object", CLASS_BASIC, 4, {
+        { true,  "out_string", "SELF_TYPE",  1, { { "arg", "String" } } },
+        { true,  "out_int",    "SELF_TYPE",  1, { { "arg", "Int" } } },
+        { true,  "in_string",  "String",     0, {} },
+        { true,  "in_int",     "Int",        0, {} } } },
+    { "Int", "Object", CLASS_BASIC | CLASS_NON_INHERITABLE, 1, {
+        { false, "_val",       "_prim_slot", 0, {} } } },
+    { "Bool", "Object", CLASS_BASIC | CLASS_NON_INHERITABLE, 1, {
+        { false, "_val",       "_prim_slot", 0, {} } } },
+    { "String", "Object", CLASS_BASIC | CLASS_NON_INHERITABLE, 5, {
+        { false, "_val",       "Int",        0, {} },
+        { false, "_str_field", "_prim_slot", 0, {} },
+        { true,  "length",     "Int",        0, {} },
+        { true,  "concat",     "String",     1, { { "arg", "String" } } },
+        { true,  "substr",     "String",     2, { { "arg", "Int" }, { "arg2", "Int" } } } } },
+};
+
+static const int BASIC_CLASS_COUNT = sizeof(BASIC_CLASSES) / sizeof(BASIC_CLASSES[0]);
+
+// 按BASIC_CLASSES构造的AST节点，进程中只构造一次
+static Class_ basic_class_nodes[BASIC_CLASS_COUNT];
+
+static void build_basic_classes(void)
+{
+    for (int k = 0; k < BASIC_CLASS_COUNT; k++)
+    {
+        const BasicClass& info = BASIC_CLASSES[k];
+        
+        Features features = nil_Features();
+        for (int i = 0; i < info.feature_count; i++)
+        {
+            const BasicFeature& f = info.features[i];
+            Feature feature;
+            if (f.is_method)
+            {
+                Formals formals = nil_Formals();
+                for (int j = 0; j < f.formal_count; j++)
+                {
+                    formals = append_Formals(formals,
+                                             single_Formals(formal(idtable.add_string(f.formals[j].name),
+                                                                   idtable.add_string(f.formals[j].type))));
+                }
+                feature = method(idtable.add_string(f.name), formals, idtable.add_string(f.type), no_expr());
+            }
+            else
+            {
+                feature = attr(idtable.add_string(f.name), idtable.add_string(f.type), no_expr());
+            }
+            features = append_Features(features, single_Features(feature));
+        }
+        
+        basic_class_nodes[k] = class_(idtable.add_string(info.name),
+                                      idtable.add_string(info.parent),
+                                      features,
+                                      basic_class_filename);
+    }
+}
+
 //////////////////////////////////////////////////////////////////////
 // 初始化符号
 //////////////////////////////////////////////////////////////////////
 
-static void initialize_constants(void)
+static void intern_constants(void)
 {
     Int        = idtable.add_string("Int");
     Float      = idtable.add_string("Float");
     String     = idtable.add_string("String");
+    Str        = String;
     Bool       = idtable.add_string("Bool");
     Object     = idtable.add_string("Object");
+    IO         = idtable.add_string("IO");
     SELF_TYPE  = idtable.add_string("SELF_TYPE");
     No_type    = idtable.add_string("_no_type");
+    Err_type   = idtable.add_string("_err_type");
 
     arg        = idtable.add_string("arg");
     arg2       = idtable.add_string("arg2");
@@ -96,1148 +235,3828 @@ static void initialize_constants(void)
     type_name  = idtable.add_string("type_name");
     val        = idtable.add_string("_val");
     self       = idtable.add_string("self");
+    
+    basic_class_filename = stringtable.add_string("<basic class>");
 }
 
-//////////////////////////////////////////////////////////////////////
-// ClassTable类实现
-//////////////////////////////////////////////////////////////////////
-
-ClassTable::ClassTable(Classes classes) : semant_errors(0), error_stream(cerr)
+// 符号和基本类在进程中只初始化一次，多次分析（包括并发的）共用
+static void initialize_constants(void)
 {
-    // 初始化符号
-    initialize_constants();
-    
-    // 初始化类表
-    class_table = new SymbolTable<Symbol, Class_>();
-    
-    // 安装基本类
-    install_basic_classes();
-    
-    // 构建继承图
-    build_inheritance_graph(classes);
-    
-    // 检查继承关系
-    check_inheritance();
+    static std::once_flag initialized;
+    std::call_once(initialized, []() {
+        intern_constants();
+        build_basic_classes();
+    });
 }
 
 //////////////////////////////////////////////////////////////////////
-// 1. 安装基本类（install_basic_classes）
+// 列表的扁平化
 //////////////////////////////////////////////////////////////////////
 
-void ClassTable::install_basic_classes()
-{
-    // 创建基本类的AST节点
-    
-    // Object类
-    Object_class = class_(Object, 
-                         No_class,
-                         append_Features(
-                             append_Features(
-                                 single_Features(method(cool_abort, nil_Formals(), Object, no_expr())),
-                                 single_Features(method(type_name, nil_Formals(), String, no_expr()))),
-                             single_Features(method(copy, nil_Formals(), SELF_TYPE, no_expr()))),
-                         filename);
-    
-    // IO类
-    IO_class = class_(IO,
-                     Object,
-                     append_Features(
-                         append_Features(
-                             append_Features(
-                                 single_Features(method(out_string, 
-                                                      single_Formals(formal(arg, String)),
-                                                      SELF_TYPE, 
-                                                      no_expr())),
-                                 single_Features(method(out_int,
-                                                      single_Formals(formal(arg, Int)),
-                                                      SELF_TYPE,
-                                                      no_expr()))),
-                             single_Features(method(in_string, nil_Formals(), String, no_expr()))),
-                         single_Features(method(in_int, nil_Formals(), Int, no_expr()))),
-                     filename);
-    
-    // Int类
-    Int_class = class_(Int,
-                      Object,
-                      single_Features(attr(val, prim_slot, no_expr())),
-                      filename);
-    
-    // Bool类
-    Bool_class = class_(Bool,
-                       Object,
-                       single_Features(attr(val, prim_slot, no_expr())),
-                       filename);
-    
-    // String类
-    String_class = class_(String,
-                         Object,
-                         append_Features(
-                             append_Features(
-                                 append_Features(
-                                     append_Features(
-                                         single_Features(attr(val, Int, no_expr())),
-                                         single_Features(attr(str_field, prim_slot, no_expr()))),
-                                     single_Features(method(length, nil_Formals(), Int, no_expr()))),
-                                 single_Features(method(concat, 
-                                                      single_Formals(formal(arg, String)),
-                                                      String,
-                                                      no_expr()))),
-                             single_Features(method(substr, 
-                                                  append_Formals(single_Formals(formal(arg, Int)),
-                                                                single_Formals(formal(arg2, Int))),
-                                                  String,
-                                                  no_expr()))),
-                         filename);
-    
-    // 将基本类添加到类表中
-    class_table->enterscope();
-    class_table->addid(Object, &Object_class);
-    class_table->addid(IO, &IO_class);
-    class_table->addid(Int, &Int_class);
-    class_table->addid(Bool, &Bool_class);
-    class_table->addid(String, &String_class);
-}
+// tree.h把append_node的两个子列表和single_list_node的元素声明为私有。
+// 显式实例化的模板实参不做访问检查，下面ListAccess的显式实例化在
+// 静态初始化时把这些成员指针记到ListLayout中
+template <class Elem>
+struct ListLayout {
+    static list_node<Elem>* append_node<Elem>::* some;
+    static list_node<Elem>* append_node<Elem>::* rest;
+    static Elem single_list_node<Elem>::* elem;
+};
 
-//////////////////////////////////////////////////////////////////////
-// 2. 构建继承图（build_inheritance_graph）
-//////////////////////////////////////////////////////////////////////
+template <class Elem> list_node<Elem>* append_node<Elem>::* ListLayout<Elem>::some = NULL;
+template <class Elem> list_node<Elem>* append_node<Elem>::* ListLayout<Elem>::rest = NULL;
+template <class Elem> Elem single_list_node<Elem>::* ListLayout<Elem>::elem = NULL;
 
-void ClassTable::build_inheritance_graph(Classes classes)
+template <class Elem,
+          list_node<Elem>* append_node<Elem>::* Some,
+          list_node<Elem>* append_node<Elem>::* Rest,
+          Elem single_list_node<Elem>::* Single>
+struct ListAccess {
+    static bool installed;
+};
+
+template <class Elem,
+          list_node<Elem>* append_node<Elem>::* Some,
+          list_node<Elem>* append_node<Elem>::* Rest,
+          Elem single_list_node<Elem>::* Single>
+bool ListAccess<Elem, Some, Rest, Single>::installed =
+    (ListLayout<Elem>::some = Some, ListLayout<Elem>::rest = Rest, ListLayout<Elem>::elem = Single, true);
+
+template <class Elem>
+void flatten_list(list_node<Elem>* list, std::vector<Elem>& out)
 {
-    // 遍历所有用户定义的类
-    for(int i = classes->first(); classes->more(i); i = classes->next(i))
+    typedef ListLayout<Elem> Layout;
+    if (Layout::some == NULL)
     {
-        Class_ c = classes->nth(i);
-        Symbol name = c->get_name();
-        
-        if (semant_debug) {
-            cerr << "构建继承图: 处理类 " << name << endl;
-        }
-        
-        // 检查是否重复定义
-        if (class_table->probe(name) != NULL)
+        // 其它文件的静态初始化中调用，成员指针还没有设置
+        int n = list->len();
+        for (int i = 0; i < n; i++)
         {
-            semant_error(c) << "Class " << name << " was previously defined." << endl;
-            semant_errors++;
+            out.push_back(list->nth(i));
         }
-        else if (name == SELF_TYPE)
+        return;
+    }
+    
+    // 先序遍历append树：右子树先入栈，左子树先出栈
+    std::vector<list_node<Elem>*> pending(1, list);
+    while (!pending.empty())
+    {
+        list_node<Elem>* node = pending.back();
+        pending.pop_back();
+        if (append_node<Elem>* pair = dynamic_cast<append_node<Elem>*>(node))
         {
-            semant_error(c) << "Class cannot be named SELF_TYPE." << endl;
-            semant_errors++;
+            pending.push_back(pair->*Layout::rest);
+            pending.push_back(pair->*Layout::some);
         }
-        else
+        else if (single_list_node<Elem>* single = dynamic_cast<single_list_node<Elem>*>(node))
         {
-            // 分配新内存存储类信息，避免局部变量被销毁
-            Class_ *class_ptr = new Class_(c);
-            class_table->addid(name, class_ptr);
+            out.push_back(single->*Layout::elem);
         }
     }
 }
 
+#define INSTANTIATE_FLATTEN_LIST(Elem)                                         \
+    template struct ListAccess<Elem, &append_node<Elem>::some,                 \
+                               &append_node<Elem>::rest,                       \
+                               &single_list_node<Elem>::elem>;                 \
+    template void flatten_list<Elem>(list_node<Elem>*, std::vector<Elem>&)
+
+INSTANTIATE_FLATTEN_LIST(Class_);
+INSTANTIATE_FLATTEN_LIST(Feature);
+INSTANTIATE_FLATTEN_LIST(Formal);
+INSTANTIATE_FLATTEN_LIST(Expression);
+INSTANTIATE_FLATTEN_LIST(Case);
+
+#undef INSTANTIATE_FLATTEN_LIST
+
 //////////////////////////////////////////////////////////////////////
-// 3. 检查继承关系（check_inheritance）
+// 表达式节点种类
 //////////////////////////////////////////////////////////////////////
 
-void ClassTable::check_inheritance()
+// 节点的动态类型 -> 种类，第一次使用时建立
+static const std::unordered_map<std::type_index, ExprKind>& expr_kind_table()
 {
-    if (semant_debug) {
-        cerr << "开始检查继承关系" << endl;
+    static const std::unordered_map<std::type_index, ExprKind> table = {
+        { typeid(assign_class),          EXPR_ASSIGN },
+        { typeid(static_dispatch_class), EXPR_STATIC_DISPATCH },
+        { typeid(dispatch_class),        EXPR_DISPATCH },
+        { typeid(cond_class),            EXPR_COND },
+        { typeid(loop_class),            EXPR_LOOP },
+        { typeid(typcase_class),         EXPR_TYPCASE },
+        { typeid(block_class),           EXPR_BLOCK },
+        { typeid(let_class),             EXPR_LET },
+        { typeid(plus_class),            EXPR_PLUS },
+        { typeid(sub_class),             EXPR_SUB },
+        { typeid(mul_class),             EXPR_MUL },
+        { typeid(divide_class),          EXPR_DIVIDE },
+        { typeid(neg_class),             EXPR_NEG },
+        { typeid(lt_class),              EXPR_LT },
+        { typeid(eq_class),              EXPR_EQ },
+        { typeid(leq_class),             EXPR_LEQ },
+        { typeid(comp_class),            EXPR_COMP },
+        { typeid(int_const_class),       EXPR_INT_CONST },
+        { typeid(bool_const_class),      EXPR_BOOL_CONST },
+        { typeid(string_const_class),    EXPR_STRING_CONST },
+        { typeid(new__class),            EXPR_NEW },
+        { typeid(isvoid_class),          EXPR_ISVOID },
+        { typeid(no_expr_class),         EXPR_NO_EXPR },
+        { typeid(object_class),          EXPR_OBJECT },
+    };
+    return table;
+}
+
+ExprKind expr_kind(Expression expr)
+{
+    const std::unordered_map<std::type_index, ExprKind>& table = expr_kind_table();
+    std::unordered_map<std::type_index, ExprKind>::const_iterator it = table.find(typeid(*expr));
+    return it == table.end() ? EXPR_NO_EXPR : it->second;
+}
+
+// 按源程序顺序把expr的直接子表达式追加到children
+static void expression_children(Expression expr, std::vector<Expression>& children)
+{
+    switch (expr_kind(expr))
+    {
+    case EXPR_ASSIGN:
+        children.push_back(((assign_class*)expr)->get_expr());
+        break;
+    case EXPR_STATIC_DISPATCH:
+    {
+        static_dispatch_class* e = (static_dispatch_class*)expr;
+        children.push_back(e->get_expr());
+        flatten_list(e->get_actuals(), children);
+        break;
     }
-    
-    // 收集所有类名
-    std::vector<Symbol> class_names;
-    for (ClassTable::iterator it = begin(); it != end(); ++it)
+    case EXPR_DISPATCH:
     {
-        class_names.push_back(it->first);
+        dispatch_class* e = (dispatch_class*)expr;
+        children.push_back(e->get_expr());
+        flatten_list(e->get_actuals(), children);
+        break;
     }
-    
-    // 检查每个类的继承关系
-    for (Symbol class_name : class_names)
+    case EXPR_COND:
     {
-        Class_ *class_ptr = class_table->lookup(class_name);
-        if (class_ptr == NULL) continue;
-        
-        Class_ c = *class_ptr;
-        Symbol parent = c->get_parent();
-        Symbol name = c->get_name();
-        
-        if (semant_debug) {
-            cerr << "检查类 " << name << " 的继承关系，父类: " << parent << endl;
-        }
-        
-        // 检查父类是否存在
-        if (parent != No_class)
-        {
-            // 检查不能继承基本类型
-            if (parent == Int || parent == Float || parent == String || parent == Bool)
-            {
-                semant_error(c) << "Class " << name << " cannot inherit from built-in type " << parent << "." << endl;
-                semant_errors++;
-            }
-            else if (class_table->lookup(parent) == NULL)
-            {
-                semant_error(c) << "Class " << name << " inherits from an undefined class " << parent << "." << endl;
-                semant_errors++;
-            }
-            else
-            {
-                // 检查继承循环
-                std::set<Symbol> visited;
-                visited.insert(name);
-                
-                Symbol current = parent;
-                while (current != No_class)
-                {
-                    if (visited.find(current) != visited.end())
-                    {
-                        semant_error(c) << "Class " << name 
-                            << ", or an ancestor of " << name 
-                            << ", is involved in an inheritance cycle." << endl;
-                        semant_errors++;
-                        break;
-                    }
-                    
-                    visited.insert(current);
-                    
-                    Class_ *parent_class_ptr = class_table->lookup(current);
-                    if (parent_class_ptr == NULL) break;
-                    
-                    Class_ parent_class = *parent_class_ptr;
-                    current = parent_class->get_parent();
-                }
-            }
-        }
+        cond_class* e = (cond_class*)expr;
+        children.push_back(e->get_pred());
+        children.push_back(e->get_then_exp());
+        children.push_back(e->get_else_exp());
+        break;
+    }
+    case EXPR_LOOP:
+        children.push_back(((loop_class*)expr)->get_pred());
+        children.push_back(((loop_class*)expr)->get_body());
+        break;
+    case EXPR_TYPCASE:
+    {
+        typcase_class* e = (typcase_class*)expr;
+        children.push_back(e->get_expr());
+        Cases cases = e->get_cases();
+        for(int i = cases->first(); cases->more(i); i = cases->next(i))
+            children.push_back(((branch_class*)cases->nth(i))->get_expr());
+        break;
+    }
+    case EXPR_BLOCK:
+        flatten_list(((block_class*)expr)->get_body(), children);
+        break;
+    case EXPR_LET:
+        children.push_back(((let_class*)expr)->get_init());
+        children.push_back(((let_class*)expr)->get_body());
+        break;
+    case EXPR_PLUS:
+        children.push_back(((plus_class*)expr)->get_e1());
+        children.push_back(((plus_class*)expr)->get_e2());
+        break;
+    case EXPR_SUB:
+        children.push_back(((sub_class*)expr)->get_e1());
+        children.push_back(((sub_class*)expr)->get_e2());
+        break;
+    case EXPR_MUL:
+        children.push_back(((mul_class*)expr)->get_e1());
+        children.push_back(((mul_class*)expr)->get_e2());
+        break;
+    case EXPR_DIVIDE:
+        children.push_back(((divide_class*)expr)->get_e1());
+        children.push_back(((divide_class*)expr)->get_e2());
+        break;
+    case EXPR_LT:
+        children.push_back(((lt_class*)expr)->get_e1());
+        children.push_back(((lt_class*)expr)->get_e2());
+        break;
+    case EXPR_EQ:
+        children.push_back(((eq_class*)expr)->get_e1());
+        children.push_back(((eq_class*)expr)->get_e2());
+        break;
+    case EXPR_LEQ:
+        children.push_back(((leq_class*)expr)->get_e1());
+        children.push_back(((leq_class*)expr)->get_e2());
+        break;
+    case EXPR_NEG:
+        children.push_back(((neg_class*)expr)->get_e1());
+        break;
+    case EXPR_COMP:
+        children.push_back(((comp_class*)expr)->get_e1());
+        break;
+    case EXPR_ISVOID:
+        children.push_back(((isvoid_class*)expr)->get_e1());
+        break;
+    default:
+        break;
+    }
+}
+
+// 先序收集表达式。用显式栈代替递归，嵌套很深的表达式也不会耗尽调用栈
+void collect_expressions(Expression root, std::vector<Expression>& nodes)
+{
+    std::vector<Expression> pending(1, root); // 待访问的表达式，栈顶先访问
+    while (!pending.empty())
+    {
+        Expression expr = pending.back();
+        pending.pop_back();
+        nodes.push_back(expr);
+
+        // 子表达式逆序留在栈上，使第一个子表达式先被访问
+        size_t mark = pending.size();
+        expression_children(expr, pending);
+        std::reverse(pending.begin() + mark, pending.end());
     }
 }
 
 //////////////////////////////////////////////////////////////////////
-// 4. 类型检查系统（核心功能）
+// 表达式编号（ExprIndex）和推断类型（ExprTypes）实现
 //////////////////////////////////////////////////////////////////////
 
-// 检查子类型关系
-bool ClassTable::is_subtype(Symbol child, Symbol parent)
+NodeId ExprIndex::add(Expression root)
 {
-    if (semant_debug) {
-        cerr << "检查子类型关系: " << child << " <: " << parent << endl;
-    }
-    
-    // SELF_TYPE的特殊处理
-    if (child == SELF_TYPE && parent == SELF_TYPE)
-    {
-        return true;
-    }
-    
-    // SELF_TYPE可以赋值给任何类型
-    if (child == SELF_TYPE)
+    NodeId base = nodes.size();
+    std::vector<int> parent;               // 本次编号的节点的父节点，相对base
+    std::vector<std::pair<Expression, int> > pending(1, std::make_pair(root, -1));
+    std::vector<Expression> children;
+    while (!pending.empty())
     {
-        return true;
+        Expression expr = pending.back().first;
+        int id = nodes.size() - base;
+        parent.push_back(pending.back().second);
+        pending.pop_back();
+        
+        nodes.push_back(expr);
+        kinds.push_back(expr == NULL ? EXPR_NO_EXPR : expr_kind(expr));
+        if (expr == NULL) continue;
+        
+        // 子表达式逆序留在栈上，使第一个子表达式先被编号
+        children.clear();
+        expression_children(expr, children);
+        for (size_t k = children.size(); k > 0; k--)
+        {
+            pending.push_back(std::make_pair(children[k - 1], id));
+        }
     }
     
-    // 任何类型不能赋值给SELF_TYPE（除非也是SELF_TYPE）
-    if (parent == SELF_TYPE)
+    // 先序中子节点总在父节点之后，逆序累加得到子树大小
+    sizes.resize(nodes.size(), 1);
+    for (int k = parent.size() - 1; k > 0; k--)
     {
-        return false;
+        sizes[base + parent[k]] += sizes[base + k];
     }
-    
-    // 相同类型
-    if (child == parent)
+    return base;
+}
+
+void ExprTypes::load(const ExprIndex& index)
+{
+    types.resize(index.size());
+    for (NodeId id = 0; id < index.size(); id++)
     {
-        return true;
+        Expression expr = index.node(id);
+        types[id] = expr == NULL ? NULL : expr->get_type();
     }
-    
-    // 检查继承关系
-    Class_ *child_class_ptr = class_table->lookup(child);
-    if (child_class_ptr == NULL) return false;
-    
-    Class_ child_class = *child_class_ptr;
-    Symbol current_parent = child_class->get_parent();
-    
-    while (current_parent != No_class)
+}
+
+void ExprTypes::publish(const ExprIndex& index) const
+{
+    for (NodeId id = 0; id < index.size(); id++)
     {
-        if (current_parent == parent)
-        {
-            return true;
-        }
-        
-        Class_ *parent_class_ptr = class_table->lookup(current_parent);
-        if (parent_class_ptr == NULL) break;
-        
-        Class_ parent_class = *parent_class_ptr;
-        current_parent = parent_class->get_parent();
+        Expression expr = index.node(id);
+        if (expr != NULL) expr->set_type(types[id]);
     }
-    
-    return false;
 }
 
 //////////////////////////////////////////////////////////////////////
-// 5. 类型推断和LUB（Least Upper Bound）
+// 对象环境（ObjectEnv）实现
 //////////////////////////////////////////////////////////////////////
 
-Symbol ClassTable::lub(Symbol type1, Symbol type2)
+ObjectEnv::ObjectEnv() : index_keys(64, (Symbol)NULL), index_values(64, -1), index_used(0), outer(NULL),
+                         peak_scopes(0)
 {
-    if (semant_debug) {
-        cerr << "计算LUB: " << type1 << " ∨ " << type2 << endl;
+}
+
+int ObjectEnv::slot(Symbol name) const
+{
+    size_t mask = index_keys.size() - 1;
+    size_t i = (((size_t)name) >> 4) * 2654435761u & mask;
+    while (index_keys[i] != NULL && index_keys[i] != name)
+    {
+        i = (i + 1) & mask;
     }
+    return i;
+}
+
+void ObjectEnv::grow_index()
+{
+    std::vector<Symbol> old_keys;
+    std::vector<int> old_values;
+    old_keys.swap(index_keys);
+    old_values.swap(index_values);
     
-    // 如果两个类型都是SELF_TYPE，返回SELF_TYPE
-    if (type1 == SELF_TYPE && type2 == SELF_TYPE)
+    index_keys.assign(old_keys.size() * 2, (Symbol)NULL);
+    index_values.assign(old_keys.size() * 2, -1);
+    for (size_t i = 0; i < old_keys.size(); i++)
     {
-        return SELF_TYPE;
+        if (old_keys[i] == NULL) continue;
+        int j = slot(old_keys[i]);
+        index_keys[j] = old_keys[i];
+        index_values[j] = old_values[i];
     }
-    
-    // 如果只有一个类型是SELF_TYPE，返回Object
-    if (type1 == SELF_TYPE || type2 == SELF_TYPE)
+}
+
+void ObjectEnv::addid(Symbol name, Symbol type)
+{
+    int i = slot(name);
+    if (index_keys[i] == NULL)
     {
-        return Object;
+        // 名字第一次出现，负载超过一半时扩容
+        if ((index_used + 1) * 2 > (int)index_keys.size())
+        {
+            grow_index();
+            i = slot(name);
+        }
+        index_keys[i] = name;
+        index_used++;
     }
     
-    // 如果type1是type2的子类型，返回type2
-    if (is_subtype(type1, type2))
+    Binding binding;
+    binding.name = name;
+    binding.type = type;
+    binding.shadowed = index_values[i];
+    index_values[i] = bindings.size();
+    bindings.push_back(binding);
+}
+
+void ObjectEnv::exitscope()
+{
+    int mark = scope_marks.back();
+    scope_marks.pop_back();
+    
+    // 从后往前撤销本作用域的绑定，恢复被遮蔽的绑定
+    while ((int)bindings.size() > mark)
     {
-        return type2;
+        const Binding &binding = bindings.back();
+        index_values[slot(binding.name)] = binding.shadowed;
+        bindings.pop_back();
     }
-    
-    // 如果type2是type1的子类型，返回type1
-    if (is_subtype(type2, type1))
+}
+
+Symbol ObjectEnv::lookup(Symbol name) const
+{
+    int i = index_values[slot(name)];
+    if (i >= 0) return bindings[i].type;
+    return outer != NULL ? outer->lookup(name) : NULL;
+}
+
+Symbol ObjectEnv::probe(Symbol name) const
+{
+    int i = index_values[slot(name)];
+    if (i < 0 || scope_marks.empty() || i < scope_marks.back()) return NULL;
+    return bindings[i].type;
+}
+
+void ObjectEnv::clear()
+{
+    while (!scope_marks.empty())
     {
-        return type1;
+        exitscope();
     }
-    
-    // 寻找共同祖先
-    std::vector<Symbol> type1_ancestors;
-    Symbol current = type1;
-    while (current != No_class)
+}
+
+//////////////////////////////////////////////////////////////////////
+// 诊断信息（Diagnostics）实现
+//////////////////////////////////////////////////////////////////////
+
+struct DiagInfo {
+    const char* name;                      // JSON输出中的错误码
+    const char* format;                    // 消息模板，%0..%3为参数
+};
+
+// 与DiagCode一一对应
+static const DiagInfo DIAG_INFO[DIAG_CODE_COUNT] = {
+    { "class-redefined", "Class %0 was previously defined." },
+    { "class-named-self-type", "Class cannot be named SELF_TYPE." },
+    { "inherit-basic", "Class %0 cannot inherit from built-in type %1." },
+    { "inherit-undefined", "Class %0 inherits from an undefined class %1." },
+    { "inherit-cycle", "Class %0, or an ancestor of %0, is involved in an inheritance cycle." },
+    { "undeclared-identifier", "Undeclared identifier %0." },
+    { "assign-undeclared", "Assignment to undeclared variable %0." },
+    { "assign-type", "Type %0 of assigned expression does not conform to declared type %1 of identifier %2." },
+    { "undefined-method", "Dispatch to undefined method %0." },
+    { "wrong-argument-count", "Method %0 called with wrong number of arguments." },
+    { "argument-type", "In call of method %0, type %1 of parameter %2 does not conform to declared type %3." },
+    { "static-dispatch-type", "Expression type %0 does not conform to declared static dispatch type %1." },
+    { "if-predicate", "Predicate of 'if' does not have type Bool." },
+    { "loop-condition", "Loop condition does not have type Bool." },
+    { "let-undefined-type", "Class %0 of let-bound identifier %1 is undefined." },
+    { "let-init-type", "Inferred type %0 of initialization of %1 does not conform to identifier's declared type %2." },
+    { "arith-non-int", "non-Int arguments: %0 + %1" },
+    { "basic-comparison", "Illegal comparison with a basic type." },
+    { "new-undefined", "'new' used with undefined class %0." },
+    { "attr-undefined-type", "Class %0 of attribute %1 is undefined." },
+    { "attr-init-type", "Inferred type %0 of initialization of attribute %1 does not conform to declared type %2." },
+    { "return-undefined", "Undefined return type %0 in method %1." },
+    { "formal-undefined-type", "Class %0 of formal parameter %1 is undefined." },
+    { "formal-redefined", "Formal parameter %0 is multiply defined." },
+    { "return-type", "Inferred return type %0 of method %1 does not conform to declared return type %2." },
+    { "override-arity", "In redefined method %0, parameter number differs from original." },
+    { "override-formal", "In redefined method %0, parameter type %1 differs from original type %2." },
+    { "override-return", "In redefined method %0, return type %1 differs from original return type %2." }
+};
+
+void Diagnostics::report(const char* filename, tree_node* node, DiagCode code,
+                         DiagArg a0, DiagArg a1, DiagArg a2, DiagArg a3)
+{
+    Diagnostic record;
+    record.filename = filename;
+    record.node = node;
+    record.line = node->get_line_number();
+    record.code = code;
+    record.args[0] = a0;
+    record.args[1] = a1;
+    record.args[2] = a2;
+    record.args[3] = a3;
+    records.push_back(record);
+}
+
+// 按模板格式化一条记录的消息
+static void format_message(ostream& out, const Diagnostic& record)
+{
+    for (const char* p = DIAG_INFO[record.code].format; *p != '\0'; p++)
     {
-        type1_ancestors.push_back(current);
-        Class_ *class_ptr = class_table->lookup(current);
-        if (class_ptr == NULL) break;
-        Class_ c = *class_ptr;
-        current = c->get_parent();
+        if (p[0] == '%' && p[1] >= '0' && p[1] <= '3')
+        {
+            const DiagArg& arg = record.args[*++p - '0'];
+            if (arg.symbol != NULL) out << arg.symbol;
+            else out << arg.number;
+        }
+        else
+        {
+            out << *p;
+        }
     }
-    type1_ancestors.push_back(Object);
-    
-    // 检查type2的祖先
-    current = type2;
-    while (current != No_class)
+}
+
+static void write_json_string(ostream& out, const std::string& text)
+{
+    out << '"';
+    for (size_t i = 0; i < text.size(); i++)
     {
-        for (Symbol ancestor : type1_ancestors)
+        unsigned char ch = text[i];
+        if (ch == '"' || ch == '\\') out << '\\' << ch;
+        else if (ch == '\n') out << "\\n";
+        else if (ch == '\t') out << "\\t";
+        else if (ch < 0x20)
         {
-            if (current == ancestor)
-            {
-                return ancestor;
-            }
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", ch);
+            out << escaped;
         }
-        
-        Class_ *class_ptr = class_table->lookup(current);
-        if (class_ptr == NULL) break;
-        Class_ c = *class_ptr;
-        current = c->get_parent();
+        else out << ch;
     }
-    
-    // 默认返回Object
-    return Object;
+    out << '"';
 }
 
-//////////////////////////////////////////////////////////////////////
-// 6. 方法查找和重写检查
-//////////////////////////////////////////////////////////////////////
+static bool same_diagnostic(const Diagnostic& a, const Diagnostic& b)
+{
+    // 同一行上不同节点的相同错误（例如两次使用同一个未声明的名字）都要保留
+    if (a.node != b.node || a.code != b.code || strcmp(a.filename, b.filename) != 0) return false;
+    for (int i = 0; i < 4; i++)
+    {
+        if (a.args[i].symbol != b.args[i].symbol || a.args[i].number != b.args[i].number) return false;
+    }
+    return true;
+}
 
-method_class* ClassTable::find_method(Symbol class_name, Symbol method_name)
+int Diagnostics::write(ostream& out, bool json) const
 {
-    if (semant_debug) {
-        cerr << "查找方法: " << class_name << "." << method_name << endl;
+    // 文件按首次出现的顺序排列，同一文件内按行号，同一行保持报告顺序
+    std::unordered_map<std::string, int> files;
+    std::vector<std::pair<std::pair<int, int>, int> > order;
+    order.reserve(records.size());
+    for (size_t i = 0; i < records.size(); i++)
+    {
+        int file = files.emplace(records[i].filename, (int)files.size()).first->second;
+        order.push_back(std::make_pair(std::make_pair(file, records[i].line), (int)i));
     }
+    std::sort(order.begin(), order.end());
     
-    Symbol current_class = class_name;
-    
-    while (current_class != No_class)
+    std::ostringstream text;
+    if (json) text << "[";
+    int written = 0;
+    for (size_t i = 0; i < order.size(); i++)
     {
-        Class_ *class_ptr = class_table->lookup(current_class);
-        if (class_ptr == NULL) return NULL;
-        
-        Class_ c = *class_ptr;
-        Features features = c->get_features();
+        const Diagnostic& record = records[order[i].second];
         
-        // 在当前类中查找方法
-        for(int i = features->first(); features->more(i); i = features->next(i))
+        // 去重：与同一文件同一行中已经输出的记录比较，只合并同一节点报告的相同错误
+        bool duplicate = false;
+        for (size_t j = i; j > 0 && order[j - 1].first == order[i].first; j--)
         {
-            Feature f = features->nth(i);
-            method_class *method = dynamic_cast<method_class*>(f);
-            if (method != NULL && method->get_name() == method_name)
+            if (same_diagnostic(records[order[j - 1].second], record))
             {
-                if (semant_debug) {
-                    cerr << "找到方法: " << method_name << " 在类 " << current_class << endl;
-                }
-                return method;
+                duplicate = true;
+                break;
             }
         }
+        if (duplicate) continue;
         
-        // 在父类中继续查找
-        current_class = c->get_parent();
+        if (json)
+        {
+            std::ostringstream message;
+            format_message(message, record);
+            text << (written ? ",\n " : "\n ") << "{\"file\": ";
+            write_json_string(text, record.filename);
+            text << ", \"line\": " << record.line << ", \"code\": \"" << DIAG_INFO[record.code].name
+                 << "\", \"message\": ";
+            write_json_string(text, message.str());
+            text << "}";
+        }
+        else
+        {
+            text << record.filename << ":" << record.line << ": ";
+            format_message(text, record);
+            text << '\n';
+        }
+        written++;
     }
+    if (json) text << (written ? "\n]\n" : "]\n");
     
-    if (semant_debug) {
-        cerr << "未找到方法: " << method_name << endl;
-    }
-    return NULL;
+    // 一次写出，只刷新一次
+    out << text.str();
+    out.flush();
+    return written;
 }
 
 //////////////////////////////////////////////////////////////////////
-// 7. 表达式类型检查（核心实现）
+// 运行统计（--stats）
 //////////////////////////////////////////////////////////////////////
 
-Symbol ClassTable::type_check_expression(Expression expr, 
-                                         Symbol current_class,
-                                         SymbolTable<Symbol, Symbol>* object_env,
-                                         const char* filename)
+void CheckerCounters::merge(const CheckerCounters& other)
 {
-    if (expr == NULL) return No_type;
-    
-    if (semant_debug) {
-        cerr << "类型检查表达式: " << expr->get_line_number() << endl;
-    }
-    
-    Symbol result_type = No_type;
+    classes_checked += other.classes_checked;
+    expressions_checked += other.expressions_checked;
+    subtype_checks += other.subtype_checks;
+    lub_calls += other.lub_calls;
+    method_lookups += other.method_lookups;
+    chain_walk_steps += other.chain_walk_steps;
+    peak_scope_depth = std::max(peak_scope_depth, other.peak_scope_depth);
+}
+
+void SemantStats::add_phase(const char* name, double seconds, long long heap_bytes)
+{
+    for (size_t i = 0; i < phases.size(); i++)
+    {
+        if (strcmp(phases[i].name, name) == 0)
+        {
+            phases[i].seconds += seconds;
+            phases[i].heap_bytes += heap_bytes;
+            return;
+        }
+    }
+    PhaseStats phase = { name, seconds, heap_bytes };
+    phases.push_back(phase);
+}
+
+void SemantStats::merge(const SemantStats& other)
+{
+    programs += other.programs;
+    errors += other.errors;
+    for (size_t i = 0; i < other.phases.size(); i++)
+    {
+        add_phase(other.phases[i].name, other.phases[i].seconds, other.phases[i].heap_bytes);
+    }
+    counters.merge(other.counters);
+}
+
+// 已分配的堆内存字节数（所有arena之和）
+static long long heap_in_use()
+{
+    struct mallinfo2 info = mallinfo2();
+    return (long long)(info.uordblks + info.hblkhd);
+}
+
+// 记录一个阶段的耗时和堆增长；stats为NULL时什么也不做
+class PhaseTimer {
+private:
+    SemantStats* stats;
+    const char* name;
+    std::chrono::steady_clock::time_point start;
+    long long heap_start;
+    
+public:
+    PhaseTimer(SemantStats* stats, const char* name) : stats(stats), name(name), heap_start(0)
+    {
+        if (stats == NULL) return;
+        heap_start = heap_in_use();
+        start = std::chrono::steady_clock::now();
+    }
+    
+    ~PhaseTimer()
+    {
+        if (stats == NULL) return;
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        stats->add_phase(name, seconds, heap_in_use() - heap_start);
+    }
+};
+
+// 进程中所有程序的合计，退出时写入semant_stats_file
+static SemantStats stats_totals;
+static std::mutex stats_totals_lock;
+
+static void record_stats(const SemantStats& stats)
+{
+    std::lock_guard<std::mutex> guard(stats_totals_lock);
+    stats_totals.merge(stats);
+}
+
+static void write_stats_file()
+{
+    std::lock_guard<std::mutex> guard(stats_totals_lock);
+    const SemantStats& stats = stats_totals;
+    const CheckerCounters& counters = stats.counters;
+    
+    double total_seconds = 0;
+    long long total_heap = 0;
+    for (size_t i = 0; i < stats.phases.size(); i++)
+    {
+        total_seconds += stats.phases[i].seconds;
+        total_heap += stats.phases[i].heap_bytes;
+    }
+    
+    std::ostringstream json;
+    json << "{\n";
+    json << "  \"programs\": " << stats.programs << ",\n";
+    json << "  \"errors\": " << stats.errors << ",\n";
+    json << "  \"total_seconds\": " << total_seconds << ",\n";
+    json << "  \"total_heap_bytes\": " << total_heap << ",\n";
+    json << "  \"phases\": [";
+    for (size_t i = 0; i < stats.phases.size(); i++)
+    {
+        json << (i ? ",\n" : "\n") << "    {\"name\": \"" << stats.phases[i].name
+             << "\", \"seconds\": " << stats.phases[i].seconds
+             << ", \"heap_bytes\": " << stats.phases[i].heap_bytes << "}";
+    }
+    json << (stats.phases.empty() ? "],\n" : "\n  ],\n");
+    json << "  \"counters\": {\n";
+    json << "    \"classes_checked\": " << counters.classes_checked << ",\n";
+    json << "    \"expressions_checked\": " << counters.expressions_checked << ",\n";
+    json << "    \"subtype_checks\": " << counters.subtype_checks << ",\n";
+    json << "    \"lub_calls\": " << counters.lub_calls << ",\n";
+    json << "    \"method_lookups\": " << counters.method_lookups << ",\n";
+    json << "    \"average_chain_walk_depth\": "
+         << (counters.subtype_checks ? (double)counters.chain_walk_steps / counters.subtype_checks : 0.0) << ",\n";
+    json << "    \"peak_scope_depth\": " << counters.peak_scope_depth << "\n";
+    json << "  }\n";
+    json << "}\n";
+    
+    std::ofstream out(semant_stats_file, std::ios::out | std::ios::trunc);
+    out << json.str();
+    out.close();
+    if (!out)
+    {
+        cerr << "semant: cannot write stats " << semant_stats_file << endl;
+    }
+}
+
+//////////////////////////////////////////////////////////////////////
+// ClassTable类实现
+//////////////////////////////////////////////////////////////////////
+
+ClassTable::ClassTable(Classes classes, SemantStats* stats)
+{
+    // 初始化符号
+    {
+        PhaseTimer timer(stats, "initialize_constants");
+        initialize_constants();
+    }
+    
+    // 安装基本类
+    {
+        PhaseTimer timer(stats, "install_basic_classes");
+        install_basic_classes();
+    }
+    
+    // 安装缓存中的库类，它们与基本类一样不能被程序重新定义
+    if (semant_class_cache != NULL)
+    {
+        PhaseTimer timer(stats, "install_cached_classes");
+        install_cached_classes();
+    }
+    
+    // 构建继承图
+    {
+        PhaseTimer timer(stats, "build_inheritance_graph");
+        build_inheritance_graph(classes);
+    }
+    
+    // 检查继承关系
+    {
+        PhaseTimer timer(stats, "check_inheritance");
+        check_inheritance();
+    }
+    
+    // 对继承树编号，之后的子类型查询都基于区间
+    {
+        PhaseTimer timer(stats, "number_inheritance_tree");
+        number_inheritance_tree();
+    }
+    
+    // 构建方法表，之后的方法查找只需一次哈希查找
+    {
+        PhaseTimer timer(stats, "build_method_tables");
+        build_method_tables();
+    }
+    
+    // 构建属性布局
+    {
+        PhaseTimer timer(stats, "build_attribute_layouts");
+        build_attribute_layouts();
+    }
     
-    // 处理不同类型的表达式
-    if (dynamic_cast<int_const_class*>(expr) != NULL)
+    // 为表达式编号，类型检查只在连续的数组上遍历
+    {
+        PhaseTimer timer(stats, "index_expressions");
+        index_expressions();
+    }
+}
+
+//////////////////////////////////////////////////////////////////////
+// 1. 安装基本类（install_basic_classes）
+//////////////////////////////////////////////////////////////////////
+
+void ClassTable::install_basic_classes()
+{
+    // 基本类的AST节点在initialize_constants中按表构造好，这里只登记
+    for (int k = 0; k < BASIC_CLASS_COUNT; k++)
     {
-        int_const_class* int_expr = (int_const_class*)expr;
-        result_type = Int;
-        int_expr->set_type(result_type);
+        add_class(basic_class_nodes[k], BASIC_CLASSES[k].flags);
     }
-    else if (dynamic_cast<bool_const_class*>(expr) != NULL)
+    
+    Object_class = basic_class_nodes[0];
+    IO_class = basic_class_nodes[1];
+    Int_class = basic_class_nodes[2];
+    Bool_class = basic_class_nodes[3];
+    String_class = basic_class_nodes[4];
+}
+
+//////////////////////////////////////////////////////////////////////
+// 类编号管理
+//////////////////////////////////////////////////////////////////////
+
+// 为类名分配编号，并在每个元数据数组中追加一项默认值
+ClassId ClassTable::intern_class(Symbol name)
+{
+    std::unordered_map<Symbol, ClassId>::const_iterator it = class_ids.find(name);
+    if (it != class_ids.end()) return it->second;
+    
+    ClassId id = class_nodes.size();
+    class_ids[name] = id;
+    class_nodes.push_back(NULL);
+    class_names.push_back(name);
+    class_parent.push_back(NO_CLASS_ID);
+    class_depth.push_back(0);
+    class_flags.push_back(0);
+    feature_begin.push_back(0);
+    feature_end.push_back(0);
+    class_pre.push_back(-1);
+    class_post.push_back(-1);
+    class_euler.push_back(-1);
+    class_method_table.push_back(-1);
+    return id;
+}
+
+// 登记一个有定义的类，并把它的特性连续存放到class_features中
+ClassId ClassTable::add_class(Class_ c, unsigned char flags)
+{
+    ClassId id = intern_class(c->get_name());
+    class_nodes[id] = c;
+    class_flags[id] = flags | CLASS_DEFINED;
+    
+    feature_begin[id] = class_features.size();
+    flatten_list(c->get_features(), class_features);
+    feature_end[id] = class_features.size();
+    
+    for (int i = feature_begin[id]; i < feature_end[id]; i++)
     {
-        bool_const_class* bool_expr = (bool_const_class*)expr;
-        result_type = Bool;
-        bool_expr->set_type(result_type);
+        method_class *method = dynamic_cast<method_class*>(class_features[i]);
+        feature_signature.push_back(method != NULL ? add_signature(method) : -1);
     }
-    else if (dynamic_cast<string_const_class*>(expr) != NULL)
+    
+    return id;
+}
+
+// 方法的参数个数、参数类型和返回类型只在这里遍历一次Formals，
+// 调用点和重写检查都直接使用签名
+int ClassTable::add_signature(method_class* method)
+{
+    MethodSignature signature;
+    signature.arity = 0;
+    signature.formals_begin = signature_formals.size();
+    signature.return_type = method->get_return_type();
+    
+    std::vector<Formal> formals;
+    flatten_list(method->get_formals(), formals);
+    for (size_t i = 0; i < formals.size(); i++)
     {
-        string_const_class* string_expr = (string_const_class*)expr;
-        result_type = Str;
-        string_expr->set_type(result_type);
+        signature_formals.push_back(formals[i]->get_type());
+        signature.arity++;
     }
-    else if (dynamic_cast<object_class*>(expr) != NULL)
+    
+    signatures.push_back(signature);
+    return signatures.size() - 1;
+}
+
+// 所有类登记完之后再解析父类，父类可以定义在子类之后；
+// 未定义的父类也会得到一个编号，只是没有CLASS_DEFINED标志
+void ClassTable::resolve_parents()
+{
+    ClassId count = class_nodes.size();
+    for (ClassId id = 0; id < count; id++)
     {
-        object_class* obj_expr = (object_class*)expr;
-        Symbol var_name = obj_expr->get_name();
+        if (!(class_flags[id] & CLASS_DEFINED)) continue;
         
-        // 查找变量类型
-        Symbol *type_ptr = object_env->lookup(var_name);
-        if (type_ptr == NULL)
-        {
-            semant_error(filename, expr) << "Undeclared identifier " << var_name << "." << endl;
-            semant_errors++;
-            result_type = Object;
-        }
-        else
+        Symbol parent = class_nodes[id]->get_parent();
+        if (parent != No_class)
         {
-            result_type = *type_ptr;
+            ClassId parent_id = intern_class(parent);
+            class_parent[id] = parent_id;
         }
-        
-        obj_expr->set_type(result_type);
     }
-    else if (dynamic_cast<assign_class*>(expr) != NULL)
+}
+
+ClassId FrozenClassTable::class_id(Symbol name) const
+{
+    std::unordered_map<Symbol, ClassId>::const_iterator it = class_ids.find(name);
+    return it == class_ids.end() ? NO_CLASS_ID : it->second;
+}
+
+bool FrozenClassTable::is_defined(Symbol name) const
+{
+    ClassId id = class_id(name);
+    return id != NO_CLASS_ID && (class_flags[id] & CLASS_DEFINED);
+}
+
+// 报告类c中的错误，记录在类的文件名和行号上
+void ClassTable::semant_error(Class_ c, DiagCode code, DiagArg a0, DiagArg a1, DiagArg a2)
+{
+    if (semant_max_errors > 0 && diagnostics.count() >= semant_max_errors)
+    {
+        diagnostics.mark_stopped();
+        return;
+    }
+    diagnostics.report(c->get_filename()->get_string(), c, code, a0, a1, a2);
+}
+
+//////////////////////////////////////////////////////////////////////
+// 2. 构建继承图（build_inheritance_graph）
+//////////////////////////////////////////////////////////////////////
+
+void ClassTable::build_inheritance_graph(Classes classes)
+{
+    // 遍历所有用户定义的类
+    std::vector<Class_> class_list;
+    flatten_list(classes, class_list);
+    for (size_t i = 0; i < class_list.size(); i++)
     {
-        assign_class* assign_expr = (assign_class*)expr;
-        Symbol var_name = assign_expr->get_name();
+        Class_ c = class_list[i];
+        Symbol name = c->get_name();
+        
+        if (semant_debug) {
+            cerr << "构建继承图: 处理类 " << name << endl;
+        }
         
-        // 检查变量是否已声明
-        Symbol *var_type_ptr = object_env->lookup(var_name);
-        if (var_type_ptr == NULL)
+        // 检查是否重复定义
+        if (is_defined(name))
+        {
+            semant_error(c, DIAG_CLASS_REDEFINED, name);
+        }
+        else if (name == SELF_TYPE)
         {
-            semant_error(filename, expr) << "Assignment to undeclared variable " << var_name << "." << endl;
-            semant_errors++;
-            result_type = Object;
+            semant_error(c, DIAG_CLASS_NAMED_SELF_TYPE);
         }
         else
         {
-            Symbol var_type = *var_type_ptr;
-            
-            // 检查赋值表达式
-            Expression rhs = assign_expr->get_expr();
-            Symbol rhs_type = type_check_expression(rhs, current_class, object_env, filename);
-            
-            // 检查类型兼容性
-            if (rhs_type == SELF_TYPE && var_type == SELF_TYPE)
-            {
-                result_type = rhs_type;
-            }
-            else if (!is_subtype(rhs_type, var_type))
+            add_class(c, 0);
+        }
+    }
+    
+    resolve_parents();
+}
+
+//////////////////////////////////////////////////////////////////////
+// 3. 检查继承关系（check_inheritance）
+//////////////////////////////////////////////////////////////////////
+
+void ClassTable::check_inheritance()
+{
+    if (semant_debug) {
+        cerr << "开始检查继承关系" << endl;
+    }
+    
+    ClassId count = class_nodes.size();
+    
+    // 一次着色遍历找出所有沿父类链会进入继承循环的类。
+    // 每个类只有一个父类，所以从每个未访问的类出发沿父类链走即可：
+    // 遇到当前路径上的类说明成环，遇到已完成的类直接沿用它的结果。
+    // 每个类只会被加入路径一次，整体为线性时间。
+    enum { UNVISITED, ON_PATH, ACYCLIC, CYCLIC };
+    std::vector<unsigned char> color(count, UNVISITED);
+    std::vector<ClassId> path;
+    
+    for (ClassId start = 0; start < count; start++)
+    {
+        if (color[start] != UNVISITED) continue;
+        
+        int result = ACYCLIC;
+        ClassId current = start;
+        while (current != NO_CLASS_ID && (class_flags[current] & CLASS_DEFINED))
+        {
+            if (color[current] == ON_PATH)
             {
-                semant_error(filename, expr) << "Type " << rhs_type 
-                    << " of assigned expression does not conform to declared type " 
-                    << var_type << " of identifier " << var_name << "." << endl;
-                semant_errors++;
-                result_type = var_type;
+                result = CYCLIC;
+                break;
             }
-            else
+            if (color[current] != UNVISITED)
             {
-                result_type = var_type;
+                result = color[current];
+                break;
             }
+            
+            color[current] = ON_PATH;
+            path.push_back(current);
+            current = class_parent[current];
         }
         
-        assign_expr->set_type(result_type);
+        for (ClassId visited : path)
+        {
+            color[visited] = result;
+        }
+        path.clear();
     }
-    else if (dynamic_cast<dispatch_class*>(expr) != NULL)
+    
+    // 检查每个类的继承关系
+    for (ClassId id = 0; id < count; id++)
     {
-        // 动态分派表达式
-        dispatch_class* dispatch_expr = (dispatch_class*)expr;
+        if (!(class_flags[id] & CLASS_DEFINED)) continue;
         
-        // 检查被调用的表达式
-        Expression expr_obj = dispatch_expr->get_expr();
-        Symbol expr_type = type_check_expression(expr_obj, current_class, object_env, filename);
-        Symbol original_expr_type = expr_type;
+        Class_ c = class_nodes[id];
+        Symbol parent = c->get_parent();
+        Symbol name = c->get_name();
         
         if (semant_debug) {
-            cerr << "动态分派: 表达式类型 = " << expr_type << ", 原始类型 = " << original_expr_type << endl;
-        }
-        
-        // 解析SELF_TYPE用于方法查找
-        if (expr_type == SELF_TYPE)
-        {
-            expr_type = current_class;
+            cerr << "检查类 " << name << " 的继承关系，父类: " << parent << endl;
         }
         
-        // 查找方法
-        method_class* method = find_method(expr_type, dispatch_expr->get_name());
-        if (method == NULL)
-        {
-            semant_error(filename, expr) << "Dispatch to undefined method " 
-                << dispatch_expr->get_name() << "." << endl;
-            semant_errors++;
-            result_type = Object;
-        }
-        else
+        // 检查父类是否存在
+        if (parent != No_class)
         {
-            // 检查参数
-            Expressions actuals = dispatch_expr->get_actuals();
-            Formals formals = method->get_formals();
-            
-            int actual_count = 0;
-            for(int i = actuals->first(); actuals->more(i); i = actuals->next(i))
-            {
-                actual_count++;
-            }
+            ClassId parent_id = class_parent[id];
             
-            int formal_count = 0;
-            for(int i = formals->first(); formals->more(i); i = formals->next(i))
+            // 检查不能继承基本类型
+            if (parent == Float || (class_flags[parent_id] & CLASS_NON_INHERITABLE))
             {
-                formal_count++;
+                semant_error(c, DIAG_INHERIT_BASIC, name, parent);
             }
-            
-            if (actual_count != formal_count)
+            else if (!(class_flags[parent_id] & CLASS_DEFINED))
             {
-                semant_error(filename, expr) << "Method " << dispatch_expr->get_name() 
-                    << " called with wrong number of arguments." << endl;
-                semant_errors++;
+                semant_error(c, DIAG_INHERIT_UNDEFINED, name, parent);
             }
-            else
+            else if (color[id] == CYCLIC)
             {
-                // 检查每个参数的类型
-                int param_index = 0;
-                for(int i = actuals->first(), j = formals->first(); 
-                    actuals->more(i) && formals->more(j); 
-                    i = actuals->next(i), j = formals->next(j))
-                {
-                    Expression actual = actuals->nth(i);
-                    Formal formal = formals->nth(j);
-                    
-                    Symbol actual_type = type_check_expression(actual, current_class, object_env, filename);
-                    Symbol formal_type = formal->get_type();
-                    
-                    if (!is_subtype(actual_type, formal_type))
-                    {
-                        semant_error(filename, expr) << "In call of method " << dispatch_expr->get_name() 
-                            << ", type " << actual_type << " of parameter " << param_index 
-                            << " does not conform to declared type " << formal_type << "." << endl;
-                        semant_errors++;
-                    }
-                    
-                    param_index++;
-                }
+                // 检查继承循环
+                semant_error(c, DIAG_INHERIT_CYCLE, name);
             }
+        }
+    }
+}
+
+//////////////////////////////////////////////////////////////////////
+// 继承树区间编号（number_inheritance_tree）
+//////////////////////////////////////////////////////////////////////
+
+// 从Object出发对继承树做一次深度优先遍历，记录每个类的先序/后序编号。
+// 只有从Object可达的类才会被编号；存在继承错误时分析会在类型检查前停止，
+// 因此未编号的类不会出现在子类型查询中。
+void ClassTable::number_inheritance_tree()
+{
+    ClassId count = class_nodes.size();
+    
+    // 建立父类到子类的邻接表（按父类编号连续存放）
+    std::vector<int> child_start(count + 1, 0);
+    for (ClassId id = 0; id < count; id++)
+    {
+        if (class_parent[id] != NO_CLASS_ID) child_start[class_parent[id] + 1]++;
+    }
+    for (ClassId id = 0; id < count; id++)
+    {
+        child_start[id + 1] += child_start[id];
+    }
+    std::vector<ClassId> child_list(child_start[count]);
+    std::vector<int> fill(child_start.begin(), child_start.end() - 1);
+    for (ClassId id = 0; id < count; id++)
+    {
+        if (class_parent[id] != NO_CLASS_ID) child_list[fill[class_parent[id]]++] = id;
+    }
+    
+    // 用显式栈遍历，避免深继承链导致递归过深；同时记录欧拉序列
+    class_pre.assign(count, -1);
+    class_post.assign(count, -1);
+    class_euler.assign(count, -1);
+    euler_tour.clear();
+    euler_depth.clear();
+    std::vector<std::pair<ClassId, int> > stack;
+    int counter = 0;
+    
+    ClassId root = class_id(Object);
+    stack.push_back(std::make_pair(root, child_start[root]));
+    class_pre[root] = counter++;
+    class_euler[root] = 0;
+    class_depth[root] = 0;
+    euler_tour.push_back(root);
+    euler_depth.push_back(0);
+    
+    while (!stack.empty())
+    {
+        ClassId current = stack.back().first;
+        int next_child = stack.back().second;
+        
+        if (next_child < child_start[current + 1])
+        {
+            stack.back().second++;
+            ClassId child = child_list[next_child];
+            class_pre[child] = counter++;
+            class_euler[child] = euler_tour.size();
+            class_depth[child] = stack.size();
+            euler_tour.push_back(child);
+            euler_depth.push_back(stack.size());
+            stack.push_back(std::make_pair(child, child_start[child]));
+        }
+        else
+        {
+            class_post[current] = counter++;
+            stack.pop_back();
             
-            // 设置返回类型（关键：SELF_TYPE处理）
-            result_type = method->get_return_type();
-            if (result_type == SELF_TYPE)
+            // 回到父类时再次记录父类
+            if (!stack.empty())
             {
-                if (original_expr_type == SELF_TYPE)
-                {
-                    result_type = SELF_TYPE;
-                }
-                else
-                {
-                    result_type = original_expr_type;
-                }
-            }
-            
-            if (semant_debug) {
-                cerr << "动态分派返回类型: " << result_type << endl;
+                euler_tour.push_back(stack.back().first);
+                euler_depth.push_back(stack.size() - 1);
             }
         }
-        
-        dispatch_expr->set_type(result_type);
     }
-    else if (dynamic_cast<static_dispatch_class*>(expr) != NULL)
+    
+    build_lca_table();
+    
+    if (semant_debug) {
+        cerr << "继承树编号完成，共 " << (counter / 2) << " 个类" << endl;
+    }
+}
+
+// 在欧拉序列上建立稀疏表：两个类的LCA是它们首次出现位置之间深度最小的类
+void ClassTable::build_lca_table()
+{
+    int n = euler_tour.size();
+    
+    euler_log.assign(n + 1, 0);
+    for (int i = 2; i <= n; i++)
+    {
+        euler_log[i] = euler_log[i / 2] + 1;
+    }
+    
+    lca_table.assign(euler_log[n] + 1, std::vector<int>());
+    lca_table[0].resize(n);
+    for (int i = 0; i < n; i++)
+    {
+        lca_table[0][i] = i;
+    }
+    
+    for (int k = 1; k < (int)lca_table.size(); k++)
+    {
+        int half = 1 << (k - 1);
+        int count = n - (1 << k) + 1;
+        lca_table[k].resize(count);
+        for (int i = 0; i < count; i++)
+        {
+            int left = lca_table[k - 1][i];
+            int right = lca_table[k - 1][i + half];
+            lca_table[k][i] = euler_depth[left] <= euler_depth[right] ? left : right;
+        }
+    }
+}
+
+//////////////////////////////////////////////////////////////////////
+// 4. 类型检查系统（核心功能）
+//////////////////////////////////////////////////////////////////////
+
+// 检查子类型关系
+bool FrozenClassTable::is_subtype(Symbol child, Symbol parent) const
+{
+    SEMANT_TRACE_EVENT(TRACE_IS_SUBTYPE, 0, child, parent);
+    
+    // 错误类型与任何类型相容，已经报告过的错误不再引起后续错误
+    if (child == Err_type || parent == Err_type)
+    {
+        return true;
+    }
+    
+    // SELF_TYPE的特殊处理
+    if (child == SELF_TYPE && parent == SELF_TYPE)
+    {
+        return true;
+    }
+    
+    // SELF_TYPE可以赋值给任何类型
+    if (child == SELF_TYPE)
+    {
+        return true;
+    }
+    
+    // 任何类型不能赋值给SELF_TYPE（除非也是SELF_TYPE）
+    if (parent == SELF_TYPE)
+    {
+        return false;
+    }
+    
+    // 相同类型
+    if (child == parent)
+    {
+        return true;
+    }
+    
+    // 检查继承关系
+    ClassId child_id = class_id(child);
+    ClassId parent_id = class_id(parent);
+    if (child_id == NO_CLASS_ID || parent_id == NO_CLASS_ID) return false;
+    
+    return is_subtype(child_id, parent_id);
+}
+
+// child的区间必须落在parent的区间之内；不在继承树中的类不是任何类的子类型
+bool FrozenClassTable::is_subtype(ClassId child, ClassId parent) const
+{
+    if (class_pre[child] < 0 || class_pre[parent] < 0) return false;
+    
+    return class_pre[parent] <= class_pre[child] && class_post[child] <= class_post[parent];
+}
+
+// 原先沿父类链逐个比较时，从child走到parent（或走到根）的步数
+int FrozenClassTable::chain_walk_length(Symbol child, Symbol parent) const
+{
+    ClassId child_id = class_id(child);
+    if (child_id == NO_CLASS_ID || class_euler[child_id] < 0) return 0;
+    int depth = euler_depth[class_euler[child_id]];
+    
+    ClassId parent_id = class_id(parent);
+    if (parent_id != NO_CLASS_ID && class_euler[parent_id] >= 0 && is_subtype(child_id, parent_id))
+    {
+        return depth - euler_depth[class_euler[parent_id]];
+    }
+    return depth;
+}
+
+//////////////////////////////////////////////////////////////////////
+// 5. 类型推断和LUB（Least Upper Bound）
+//////////////////////////////////////////////////////////////////////
+
+Symbol FrozenClassTable::lub(Symbol type1, Symbol type2) const
+{
+    SEMANT_TRACE_EVENT(TRACE_LUB, 0, type1, type2);
+    
+    // 错误类型向上传播
+    if (type1 == Err_type || type2 == Err_type)
+    {
+        return Err_type;
+    }
+    
+    // 如果两个类型都是SELF_TYPE，返回SELF_TYPE
+    if (type1 == SELF_TYPE && type2 == SELF_TYPE)
+    {
+        return SELF_TYPE;
+    }
+    
+    // 如果只有一个类型是SELF_TYPE，返回Object
+    if (type1 == SELF_TYPE || type2 == SELF_TYPE)
+    {
+        return Object;
+    }
+    
+    // 相同类型
+    if (type1 == type2)
+    {
+        return type2;
+    }
+    
+    ClassId id1 = class_id(type1);
+    ClassId id2 = class_id(type2);
+    if (id1 == NO_CLASS_ID || id2 == NO_CLASS_ID || class_euler[id1] < 0 || class_euler[id2] < 0)
+    {
+        // 未定义的类型，默认返回Object
+        return Object;
+    }
+    
+    return class_names[lub(id1, id2)];
+}
+
+// 两个类的LCA：欧拉序列上首次出现位置之间深度最小的类
+ClassId FrozenClassTable::lub(ClassId type1, ClassId type2) const
+{
+    int left = std::min(class_euler[type1], class_euler[type2]);
+    int right = std::max(class_euler[type1], class_euler[type2]);
+    int k = euler_log[right - left + 1];
+    int a = lca_table[k][left];
+    int b = lca_table[k][right - (1 << k) + 1];
+    
+    return euler_tour[euler_depth[a] <= euler_depth[b] ? a : b];
+}
+
+// 多个类型的最小上界，例如多个分支的类型，按二元lub依次折叠
+Symbol FrozenClassTable::lub(const std::vector<Symbol>& types) const
+{
+    if (types.empty()) return No_type;
+    
+    Symbol result = types[0];
+    for (size_t i = 1; i < types.size(); i++)
+    {
+        result = lub(result, types[i]);
+    }
+    
+    return result;
+}
+
+//////////////////////////////////////////////////////////////////////
+// 6. 方法查找和重写检查
+//////////////////////////////////////////////////////////////////////
+
+// 按先序（欧拉序列中的首次出现）处理各类，保证父类的表先于子类构建。
+// 子类从父类的表出发，用自己定义的方法覆盖同名条目；
+// 同一个类中重复定义的方法以第一次出现的为准，与原先的链式查找一致。
+void ClassTable::build_method_tables()
+{
+    method_tables.clear();
+    class_method_table.assign(class_nodes.size(), -1);
+    
+    for (size_t i = 0; i < euler_tour.size(); i++)
+    {
+        ClassId id = euler_tour[i];
+        if (class_euler[id] != (int)i) continue;
+        
+        // 收集本类定义的方法
+        MethodTable own_methods;
+        for (int j = feature_begin[id]; j < feature_end[id]; j++)
+        {
+            if (feature_signature[j] >= 0)
+            {
+                MethodEntry entry;
+                entry.method = (method_class*)class_features[j];
+                entry.signature = feature_signature[j];
+                own_methods.insert(std::make_pair(entry.method->get_name(), entry));
+            }
+        }
+        
+        int parent_index = -1;
+        if (class_parent[id] != NO_CLASS_ID)
+        {
+            parent_index = class_method_table[class_parent[id]];
+        }
+        
+        // 没有新方法时与父类共用同一张表
+        if (own_methods.empty() && parent_index >= 0)
+        {
+            class_method_table[id] = parent_index;
+            continue;
+        }
+        
+        int index = method_tables.size();
+        if (parent_index >= 0)
+        {
+            method_tables.push_back(method_tables[parent_index]);
+        }
+        else
+        {
+            method_tables.push_back(MethodTable());
+        }
+        
+        MethodTable &table = method_tables[index];
+        for (MethodTable::const_iterator it = own_methods.begin(); it != own_methods.end(); ++it)
+        {
+            table[it->first] = it->second;
+        }
+        class_method_table[id] = index;
+    }
+}
+
+void ClassTable::build_attribute_layouts()
+{
+    layout_attrs.clear();
+    layout_begin.assign(class_nodes.size(), 0);
+    layout_end.assign(class_nodes.size(), 0);
+    
+    // 先序遍历保证父类的布局先于子类完成
+    for (size_t i = 0; i < euler_tour.size(); i++)
+    {
+        ClassId id = euler_tour[i];
+        if (class_euler[id] != (int)i) continue;
+        
+        layout_begin[id] = layout_attrs.size();
+        
+        // 先复制父类的布局，再追加本类的属性
+        ClassId parent = class_parent[id];
+        if (parent != NO_CLASS_ID)
+        {
+            for (int j = layout_begin[parent]; j < layout_end[parent]; j++)
+            {
+                layout_attrs.push_back(layout_attrs[j]);
+            }
+        }
+        for (int j = feature_begin[id]; j < feature_end[id]; j++)
+        {
+            if (feature_signature[j] < 0)
+            {
+                layout_attrs.push_back((attr_class*)class_features[j]);
+            }
+        }
+        
+        layout_end[id] = layout_attrs.size();
+    }
+}
+
+//////////////////////////////////////////////////////////////////////
+// 表达式编号
+//////////////////////////////////////////////////////////////////////
+
+// 程序中特性的表达式按特性顺序编号，块和分派参数列表在这里各遍历一次；
+// 每个类的表达式因此也占据一段连续的编号。基本类和缓存中的类的节点由
+// 所有类表共用，不参与编号，它们的编号区间为空，检查后也不会写回类型
+void ClassTable::index_expressions()
+{
+    std::vector<bool> shared(class_features.size(), false);
+    for (ClassId id = 0; id < class_nodes.size(); id++)
+    {
+        if (!(class_flags[id] & (CLASS_BASIC | CLASS_CACHED))) continue;
+        for (int i = feature_begin[id]; i < feature_end[id]; i++)
+        {
+            shared[i] = true;
+        }
+    }
+    
+    feature_expr.resize(class_features.size() + 1);
+    for (size_t i = 0; i < class_features.size(); i++)
+    {
+        Feature f = class_features[i];
+        if (shared[i])
+            feature_expr[i] = expr_index.size();
+        else if (feature_signature[i] < 0)
+            feature_expr[i] = expr_index.add(((attr_class*)f)->get_init());
+        else
+            feature_expr[i] = expr_index.add(((method_class*)f)->get_expr());
+    }
+    feature_expr[class_features.size()] = expr_index.size();
+}
+
+//////////////////////////////////////////////////////////////////////
+// 冻结类表
+//////////////////////////////////////////////////////////////////////
+
+std::shared_ptr<const FrozenClassTable> ClassTable::freeze()
+{
+    if (frozen == NULL)
+    {
+        // 构建已经结束，去掉各数组多余的容量后整体移入快照
+        class_nodes.shrink_to_fit();
+        class_features.shrink_to_fit();
+        feature_signature.shrink_to_fit();
+        signatures.shrink_to_fit();
+        signature_formals.shrink_to_fit();
+        euler_tour.shrink_to_fit();
+        euler_depth.shrink_to_fit();
+        layout_attrs.shrink_to_fit();
+        
+        frozen = std::make_shared<const FrozenClassTable>(std::move(*(FrozenClassTable*)this));
+    }
+    return frozen;
+}
+
+method_class* FrozenClassTable::find_method(Symbol class_name, Symbol method_name) const
+{
+    ClassId id = class_id(class_name);
+    method_class *method = id == NO_CLASS_ID ? NULL : find_method(id, method_name);
+    
+    SEMANT_TRACE_EVENT(TRACE_FIND_METHOD, method != NULL, class_name, method_name);
+    return method;
+}
+
+method_class* FrozenClassTable::find_method(ClassId class_id, Symbol method_name) const
+{
+    const MethodEntry *entry = find_entry(class_id, method_name);
+    return entry == NULL ? NULL : entry->method;
+}
+
+const MethodSignature* FrozenClassTable::find_signature(Symbol class_name, Symbol method_name) const
+{
+    SEMANT_TRACE_EVENT(TRACE_FIND_SIGNATURE, 0, class_name, method_name);
+    
+    ClassId id = class_id(class_name);
+    return id == NO_CLASS_ID ? NULL : find_signature(id, method_name);
+}
+
+const MethodSignature* FrozenClassTable::find_signature(ClassId class_id, Symbol method_name) const
+{
+    const MethodEntry *entry = find_entry(class_id, method_name);
+    return entry == NULL ? NULL : &signatures[entry->signature];
+}
+
+const MethodEntry* FrozenClassTable::find_entry(ClassId class_id, Symbol method_name) const
+{
+    int index = class_method_table[class_id];
+    if (index < 0) return NULL;
+    
+    const MethodTable &table = method_tables[index];
+    MethodTable::const_iterator it = table.find(method_name);
+    return it == table.end() ? NULL : &it->second;
+}
+
+//////////////////////////////////////////////////////////////////////
+// ClassChecker类实现
+//////////////////////////////////////////////////////////////////////
+
+ClassChecker::ClassChecker(const FrozenClassTable& table, ExprTypes& types, bool record_uses,
+                           std::atomic<int>* error_count, std::atomic<bool>* stopped, bool count_walks)
+    : class_table(table), index(table.expr_index), types(types), record_uses(record_uses),
+      error_count(error_count), stopped(stopped), count_walks(count_walks)
+{
+}
+
+void ClassChecker::add_counters(CheckerCounters& total) const
+{
+    CheckerCounters own = counters;
+    own.peak_scope_depth = env_stack.peak_depth() + 1; // 加上外层的属性环境
+    total.merge(own);
+}
+
+// 设置了--max-errors时，所有检查器共用的错误数达到上限后不再记录；
+// 第一次丢弃错误时记下分析已经停止。恰好有上限个错误的程序仍然完整检查
+bool ClassChecker::admit_error()
+{
+    if (semant_max_errors <= 0 || error_count == NULL) return true;
+    if (error_count->fetch_add(1, std::memory_order_relaxed) < semant_max_errors) return true;
+    if (stopped != NULL) stopped->store(true, std::memory_order_relaxed);
+    return false;
+}
+
+bool ClassChecker::error_limit_reached() const
+{
+    return stopped != NULL && stopped->load(std::memory_order_relaxed);
+}
+
+void ClassChecker::semant_error(Class_ c, DiagCode code, DiagArg a0, DiagArg a1, DiagArg a2)
+{
+    if (!admit_error()) return;
+    diagnostics.report(c->get_filename()->get_string(), c, code, a0, a1, a2);
+}
+
+void ClassChecker::semant_error(const char* filename, tree_node *t, DiagCode code,
+                                DiagArg a0, DiagArg a1, DiagArg a2, DiagArg a3)
+{
+    if (!admit_error()) return;
+    diagnostics.report(filename, t, code, a0, a1, a2, a3);
+}
+
+void ClassChecker::finish_feature(ClassCheckResult& result, int k)
+{
+    result.feature_diagnostics[k].swap(diagnostics);
+    diagnostics.clear();
+    
+    if (record_uses)
+    {
+        result.feature_uses[k].swap(uses);
+        uses.clear();
+    }
+}
+
+//////////////////////////////////////////////////////////////////////
+// 7. 表达式类型检查（核心实现）
+//////////////////////////////////////////////////////////////////////
+
+// 压入一帧。表达式为NULL或错误数已达上限时不需要检查，返回false，result为它的类型
+bool ClassChecker::enter_expression(NodeId id, Symbol& result)
+{
+    Expression expr = index.node(id);
+    if (expr == NULL)
+    {
+        result = No_type;
+        return false;
+    }
+    
+    // 错误数已达上限，不再检查
+    if (error_limit_reached())
+    {
+        result = Err_type;
+        return false;
+    }
+    
+    counters.expressions_checked++;
+    SEMANT_TRACE_EVENT(TRACE_EXPR_BEGIN, expr->get_line_number(), NULL, NULL);
+    
+    ExprFrame frame;
+    frame.id = id;
+    frame.expr = expr;
+    frame.kind = index.kind(id);
+    frame.stage = 0;
+    frame.child = id + 1;
+    frame.end = index.subtree_end(id);
+    frame.param_index = 0;
+    frame.type = NULL;
+    frame.original_type = NULL;
+    frame.signature = NULL;
+    expr_stack.push_back(frame);
+    return true;
+}
+
+// 表达式检查用显式的工作栈代替递归：栈顶的帧每次前进一步，需要先检查
+// 子表达式时压入子表达式的帧，子表达式完成后弹出，它的类型留在result中，
+// 父表达式从下一步继续。子表达式按编号依次取得：frame.child从第一个
+// 子表达式开始，每取一个就跳过它的整棵子树。对象环境的作用域、错误
+// 报告和类表查询的顺序与递归检查时完全相同。
+Symbol ClassChecker::type_check_expression(NodeId root, 
+                                           Symbol current_class,
+                                           ObjectEnv* object_env,
+                                           const char* filename)
+{
+    Symbol result = No_type;                // 最近完成的表达式的类型
+    if (!enter_expression(root, result)) return result;
+    
+    size_t base = expr_stack.size() - 1;
+    while (expr_stack.size() > base)
+    {
+        ExprFrame& frame = expr_stack.back();
+        bool descend = false;               // 需要先检查frame.child处的子表达式
+        bool done = false;
+        
+        // 按节点种类分派，每个节点只需一次查表
+        switch (frame.kind)
+        {
+        case EXPR_INT_CONST:
+        {
+            result = Int;
+            types.set(frame.id, result);
+            done = true;
+            break;
+        }
+        case EXPR_BOOL_CONST:
+        {
+            result = Bool;
+            types.set(frame.id, result);
+            done = true;
+            break;
+        }
+        case EXPR_STRING_CONST:
+        {
+            result = Str;
+            types.set(frame.id, result);
+            done = true;
+            break;
+        }
+        case EXPR_OBJECT:
+        {
+            Symbol var_name = ((object_class*)frame.expr)->get_name();
+            
+            // 查找变量类型
+            Symbol var_type = object_env->lookup(var_name);
+            if (var_type == NULL)
+            {
+                semant_error(filename, frame.expr, DIAG_UNDECLARED_IDENTIFIER, var_name);
+                result = Err_type;
+            }
+            else
+            {
+                result = var_type;
+            }
+            
+            types.set(frame.id, result);
+            done = true;
+            break;
+        }
+        case EXPR_ASSIGN:
+        {
+            assign_class* assign_expr = (assign_class*)frame.expr;
+            Symbol var_name = assign_expr->get_name();
+            
+            if (frame.stage == 0)
+            {
+                // 检查变量是否已声明
+                Symbol var_type = object_env->lookup(var_name);
+                if (var_type == NULL)
+                {
+                    semant_error(filename, frame.expr, DIAG_ASSIGN_UNDECLARED, var_name);
+                    result = Err_type;
+                    types.set(frame.id, result);
+                    done = true;
+                    break;
+                }
+                
+                // 检查赋值表达式
+                frame.type = var_type;
+                frame.stage = 1;
+                descend = true;
+                break;
+            }
+            
+            // 检查类型兼容性
+            Symbol rhs_type = result;
+            Symbol var_type = frame.type;
+            if (rhs_type == SELF_TYPE && var_type == SELF_TYPE)
+            {
+                result = rhs_type;
+            }
+            else if (!is_subtype(rhs_type, var_type))
+            {
+                semant_error(filename, frame.expr, DIAG_ASSIGN_TYPE, rhs_type, var_type, var_name);
+                result = var_type;
+            }
+            else
+            {
+                result = var_type;
+            }
+            
+            types.set(frame.id, result);
+            done = true;
+            break;
+        }
+        case EXPR_DISPATCH:
+        case EXPR_STATIC_DISPATCH:
+        {
+            // 两种分派的步骤：0 检查接收者；1 查找方法；2 接收者有错误，只检查参数；
+            // 3 一个参数检查完，检查它的类型；4 确定返回类型
+            bool is_static = frame.kind == EXPR_STATIC_DISPATCH;
+            static_dispatch_class* static_dispatch_expr = (static_dispatch_class*)frame.expr;
+            dispatch_class* dispatch_expr = (dispatch_class*)frame.expr;
+            Symbol method_name = is_static ? static_dispatch_expr->get_name() : dispatch_expr->get_name();
+            
+            if (frame.stage == 0)
+            {
+                // 检查被调用的表达式
+                frame.stage = 1;
+                descend = true;
+                break;
+            }
+            
+            if (frame.stage == 1)
+            {
+                Symbol expr_type = result;
+                frame.original_type = expr_type;
+                frame.param_index = 0;
+                
+                if (is_static)
+                {
+                    // 检查类型兼容性，在静态类型中查找方法
+                    Symbol static_type = static_dispatch_expr->get_type_name();
+                    if (!is_subtype(expr_type, static_type))
+                    {
+                        semant_error(filename, frame.expr, DIAG_STATIC_DISPATCH_TYPE, expr_type, static_type);
+                    }
+                    frame.signature = find_signature(static_type, method_name);
+                }
+                else
+                {
+                    SEMANT_TRACE_EVENT(TRACE_DISPATCH, frame.expr->get_line_number(), expr_type, method_name);
+                    
+                    // 解析SELF_TYPE用于方法查找
+                    if (expr_type == SELF_TYPE)
+                    {
+                        expr_type = current_class;
+                    }
+                    
+                    // 接收者的类型有错误时只检查参数，结果也是错误类型
+                    if (expr_type == Err_type)
+                    {
+                        frame.stage = 2;
+                        break;
+                    }
+                    frame.signature = find_signature(expr_type, method_name);
+                }
+                
+                if (frame.signature == NULL)
+                {
+                    semant_error(filename, frame.expr, DIAG_UNDEFINED_METHOD, method_name);
+                    result = Err_type;
+                    types.set(frame.id, result);
+                    done = true;
+                    break;
+                }
+                
+                // 检查参数个数：接收者之后的每棵子树是一个参数
+                int actuals = 0;
+                for (NodeId k = frame.child; k < frame.end; k = index.subtree_end(k))
+                {
+                    actuals++;
+                }
+                if (actuals != frame.signature->arity)
+                {
+                    semant_error(filename, frame.expr, DIAG_WRONG_ARGUMENT_COUNT, method_name);
+                    frame.stage = 4;
+                    break;
+                }
+                
+                frame.stage = 3;
+                if (frame.child < frame.end)
+                {
+                    descend = true;
+                }
+                else
+                {
+                    frame.stage = 4;
+                }
+                break;
+            }
+            
+            if (frame.stage == 2)
+            {
+                // 接收者有错误：依次检查参数，不检查它们的类型
+                if (frame.child < frame.end)
+                {
+                    descend = true;
+                    break;
+                }
+                result = Err_type;
+                types.set(frame.id, result);
+                done = true;
+                break;
+            }
+            
+            if (frame.stage == 3)
+            {
+                // 检查刚完成的参数的类型
+                Symbol actual_type = result;
+                Symbol formal_type = signature_formal(frame.signature, frame.param_index);
+                if (!is_subtype(actual_type, formal_type))
+                {
+                    semant_error(filename, frame.expr, DIAG_ARGUMENT_TYPE, method_name, actual_type, frame.param_index, formal_type);
+                }
+                frame.param_index++;
+                
+                if (frame.child < frame.end)
+                {
+                    descend = true;
+                    break;
+                }
+                frame.stage = 4;
+            }
+            
+            // 设置返回类型（关键：SELF_TYPE处理）
+            result = frame.signature->return_type;
+            if (result == SELF_TYPE)
+            {
+                result = is_static ? static_dispatch_expr->get_type_name() : frame.original_type;
+            }
+            
+            types.set(frame.id, result);
+            done = true;
+            break;
+        }
+        case EXPR_COND:
+        {
+            switch (frame.stage++)
+            {
+            case 0:
+                // 检查条件表达式
+                descend = true;
+                break;
+            case 1:
+                if (result != Bool && result != Err_type)
+                {
+                    semant_error(filename, frame.expr, DIAG_IF_PREDICATE);
+                }
+                // 检查then和else分支
+                descend = true;
+                break;
+            case 2:
+                frame.type = result;
+                descend = true;
+                break;
+            default:
+                // 计算最小上界作为条件表达式的类型
+                result = lub(frame.type, result);
+                types.set(frame.id, result);
+                done = true;
+                break;
+            }
+            break;
+        }
+        case EXPR_LOOP:
+        {
+            switch (frame.stage++)
+            {
+            case 0:
+                // 检查条件表达式
+                descend = true;
+                break;
+            case 1:
+                if (result != Bool && result != Err_type)
+                {
+                    semant_error(filename, frame.expr, DIAG_LOOP_CONDITION);
+                }
+                // 检查循环体
+                descend = true;
+                break;
+            default:
+                // while循环的类型总是Object
+                result = Object;
+                types.set(frame.id, result);
+                done = true;
+                break;
+            }
+            break;
+        }
+        case EXPR_BLOCK:
+        {
+            // 块表达式的类型是最后一个表达式的类型
+            if (frame.stage == 0)
+            {
+                frame.stage = 1;
+                frame.type = No_type;
+            }
+            else
+            {
+                frame.type = result;
+            }
+            
+            if (frame.child < frame.end)
+            {
+                descend = true;
+                break;
+            }
+            
+            result = frame.type;
+            types.set(frame.id, result);
+            done = true;
+            break;
+        }
+        case EXPR_LET:
+        {
+            let_class* let_expr = (let_class*)frame.expr;
+            Symbol identifier = let_expr->get_identifier();
+            
+            if (frame.stage == 0)
+            {
+                // 进入新的作用域
+                object_env->enterscope();
+                
+                // 检查类型声明是否存在
+                Symbol type_decl = let_expr->get_type_decl();
+                if (type_decl != SELF_TYPE && !is_defined(type_decl))
+                {
+                    semant_error(filename, frame.expr, DIAG_LET_UNDEFINED_TYPE, type_decl, identifier);
+                    type_decl = Err_type;
+                }
+                frame.type = type_decl;
+                
+                // 处理初始化表达式，它的编号紧跟在let之后
+                if (types.get(frame.child) != NULL)  // 检查是否为空表达式
+                {
+                    // 有初始化表达式，先检查它的类型
+                    frame.stage = 1;
+                    descend = true;
+                    break;
+                }
+                
+                // 没有初始化表达式，跳过它
+                object_env->addid(identifier, type_decl);
+                frame.stage = 2;
+                frame.child = index.subtree_end(frame.child);
+                descend = true;
+                break;
+            }
+            
+            if (frame.stage == 1)
+            {
+                if (!is_subtype(result, frame.type))
+                {
+                    semant_error(filename, frame.expr, DIAG_LET_INIT_TYPE, result, identifier, frame.type);
+                }
+                object_env->addid(identifier, frame.type);
+                
+                // 处理主体表达式
+                frame.stage = 2;
+                descend = true;
+                break;
+            }
+            
+            // 主体检查完毕，退出作用域
+            object_env->exitscope();
+            
+            types.set(frame.id, result);
+            done = true;
+            break;
+        }
+        case EXPR_PLUS:
+        case EXPR_EQ:
+        {
+            // 加法和相等比较：依次检查两个操作数
+            bool is_plus = frame.kind == EXPR_PLUS;
+            
+            if (frame.stage == 0)
+            {
+                frame.stage = 1;
+                descend = true;
+                break;
+            }
+            if (frame.stage == 1)
+            {
+                frame.type = result;
+                frame.stage = 2;
+                descend = true;
+                break;
+            }
+            
+            Symbol type1 = frame.type;
+            Symbol type2 = result;
+            if (is_plus)
+            {
+                // 两个操作数都必须是Int类型；有操作数的错误已经报告过时不再报告
+                if (type1 != Err_type && type2 != Err_type && (type1 != Int || type2 != Int))
+                {
+                    semant_error(filename, frame.expr, DIAG_ARITH_NON_INT, type1, type2);
+                }
+                result = Int;
+            }
+            else
+            {
+                // 比较操作可以比较任何类型，但Int、String、Bool只能与相同类型比较
+                if ((type1 == Int || type1 == String || type1 == Bool) && type1 != type2 && type2 != Err_type)
+                {
+                    semant_error(filename, frame.expr, DIAG_BASIC_COMPARISON);
+                }
+                result = Bool;
+            }
+            
+            types.set(frame.id, result);
+            done = true;
+            break;
+        }
+        case EXPR_NEW:
+        {
+            new__class* new_expr = (new__class*)frame.expr;
+            Symbol type_name = new_expr->get_type_name();
+            
+            // 检查类型是否存在
+            if (type_name != SELF_TYPE && !is_defined(type_name))
+            {
+                semant_error(filename, frame.expr, DIAG_NEW_UNDEFINED, type_name);
+                result = Err_type;
+            }
+            else
+            {
+                result = type_name;
+            }
+            
+            types.set(frame.id, result);
+            done = true;
+            break;
+        }
+        case EXPR_ISVOID:
+        {
+            if (frame.stage == 0)
+            {
+                // 检查表达式
+                frame.stage = 1;
+                descend = true;
+                break;
+            }
+            
+            result = Bool;
+            types.set(frame.id, result);
+            done = true;
+            break;
+        }
+        default:
+            // no_expr以及其余节点不产生类型
+            result = No_type;
+            done = true;
+            break;
+        }
+        
+        if (done)
+        {
+            SEMANT_TRACE_EVENT(TRACE_EXPR_END, expr_stack.back().expr->get_line_number(), result, NULL);
+            expr_stack.pop_back();
+        }
+        else if (descend)
+        {
+            // 取出下一个子表达式，并跳过它的子树；不需要检查的子表达式
+            // 直接得到类型，父表达式下一轮继续
+            NodeId child = frame.child;
+            frame.child = index.subtree_end(child);
+            enter_expression(child, result);
+        }
+    }
+    
+    return result;
+}
+
+//////////////////////////////////////////////////////////////////////
+// 类类型检查
+//////////////////////////////////////////////////////////////////////
+
+void ClassChecker::check_attributes(ClassId id, ClassCheckResult& result)
+{
+    Class_ c = class_table.class_nodes[id];
+    Symbol class_name = c->get_name();
+    const char* filename = c->get_filename()->get_string();
+    int begin = class_table.feature_begin[id];
+    int end = class_table.feature_end[id];
+    
+    if (semant_debug) {
+        cerr << "类型检查类: " << class_name << endl;
+    }
+    
+    counters.classes_checked++;
+    
+    // 每个特性一个错误输出槽位
+    result.feature_diagnostics.assign(end - begin, Diagnostics());
+    if (record_uses)
+    {
+        result.feature_uses.assign(end - begin, std::vector<Symbol>());
+    }
+    
+    // 创建属性环境，检查完所有属性后保留，供该类的方法共享
+    ObjectEnv* object_env = &result.attr_env;
+    object_env->clear();
+    object_env->enterscope();
+    
+    // 添加self变量（类型为SELF_TYPE）
+    object_env->addid(self, SELF_TYPE);
+    
+    // 继承的属性：父类的属性布局就是祖先类按顺序声明的全部属性
+    ClassId parent = class_table.class_parent[id];
+    for (int k = 0; parent != NO_CLASS_ID && k < class_table.attribute_count(parent); k++)
+    {
+        attr_class* inherited = class_table.attribute(parent, k);
+        Symbol inherited_type = inherited->get_type();
+        if (inherited_type != SELF_TYPE && !is_defined(inherited_type))
+        {
+            inherited_type = Err_type;     // 已在声明它的类中报告过
+        }
+        object_env->addid(inherited->get_name(), inherited_type);
+    }
+    
+    // 按顺序检查属性，初始化表达式只能看到之前的属性
+    for (int i = begin; i < end; i++)
+    {
+        if (class_table.feature_signature[i] >= 0) continue;
+        
+        attr_class* attr = (attr_class*)class_table.class_features[i];
+        Symbol attr_name = attr->get_name();
+        Symbol attr_type = attr->get_type();
+        
+        if (semant_debug) {
+            cerr << "检查属性: " << attr_name << " : " << attr_type << endl;
+        }
+        
+        // 检查属性类型是否存在
+        if (attr_type != SELF_TYPE && !is_defined(attr_type))
+        {
+            semant_error(c, DIAG_ATTR_UNDEFINED_TYPE, attr_type, attr_name);
+            attr_type = Err_type;
+        }
+        
+        // 检查初始化表达式
+        NodeId init = class_table.feature_expr[i];
+        if (types.get(init) != NULL)  // 如果有初始化表达式
+        {
+            Symbol init_type = type_check_expression(init, class_name, object_env, filename);
+            
+            if (!is_subtype(init_type, attr_type))
+            {
+                semant_error(c, DIAG_ATTR_INIT_TYPE, init_type, attr_name, attr_type);
+            }
+        }
+        
+        // 添加属性到对象环境
+        object_env->addid(attr_name, attr_type);
+        
+        finish_feature(result, i - begin);
+    }
+}
+
+void ClassChecker::check_method(ClassId id, int feature, ClassCheckResult& result)
+{
+    Class_ c = class_table.class_nodes[id];
+    Symbol class_name = c->get_name();
+    ClassId parent_id = class_table.class_parent[id];
+    const char* filename = c->get_filename()->get_string();
+    
+    method_class* method = (method_class*)class_table.class_features[feature];
+    Symbol method_name = method->get_name();
+    Symbol return_type = method->get_return_type();
+    
+    std::vector<Formal> formals;
+    flatten_list(method->get_formals(), formals);
+    
+    if (semant_debug) {
+        cerr << "检查方法: " << method_name << " : " << return_type << endl;
+    }
+    
+    // 检查返回类型
+    if (return_type != SELF_TYPE && !is_defined(return_type))
+    {
+        semant_error(c, DIAG_RETURN_UNDEFINED, return_type, method_name);
+        return_type = Err_type;
+    }
+    
+    // 进入新的作用域，属性从该类的属性环境中查找
+    ObjectEnv* object_env = &env_stack;
+    object_env->clear();
+    object_env->set_outer(&result.attr_env);
+    object_env->enterscope();
+    
+    // 添加参数到环境
+    for (size_t j = 0; j < formals.size(); j++)
+    {
+        Formal formal = formals[j];
+        Symbol formal_name = formal->get_name();
+        Symbol formal_type = formal->get_type();
+        
+        // 检查参数类型
+        if (formal_type != SELF_TYPE && !is_defined(formal_type))
+        {
+            semant_error(c, DIAG_FORMAL_UNDEFINED_TYPE, formal_type, formal_name);
+            formal_type = Err_type;
+        }
+        
+        // 检查参数名是否重复
+        Symbol existing_type = object_env->probe(formal_name);
+        if (existing_type != NULL)
+        {
+            semant_error(c, DIAG_FORMAL_REDEFINED, formal_name);
+        }
+        else
+        {
+            object_env->addid(formal_name, formal_type);
+        }
+    }
+    
+    // 检查方法体
+    Symbol expr_type = type_check_expression(class_table.feature_expr[feature], class_name, object_env, filename);
+    
+    // 检查返回类型
+    if (return_type == SELF_TYPE)
+    {
+        if (expr_type != SELF_TYPE && expr_type != Err_type)
+        {
+            semant_error(c, DIAG_RETURN_TYPE, expr_type, method_name, SELF_TYPE);
+        }
+    }
+    else if (!is_subtype(expr_type, return_type))
+    {
+        semant_error(c, DIAG_RETURN_TYPE, expr_type, method_name, return_type);
+    }
+    
+    // 退出作用域
+    object_env->exitscope();
+    
+    // 检查方法重写
+    if (parent_id != NO_CLASS_ID)
+    {
+        const MethodSignature* parent_signature = find_signature(parent_id, method_name);
+        if (parent_signature != NULL)
+        {
+            const MethodSignature* signature = &class_table.signatures[class_table.feature_signature[feature]];
+            
+            // 检查参数数量
+            if (parent_signature->arity != signature->arity)
+            {
+                semant_error(c, DIAG_OVERRIDE_ARITY, method_name);
+            }
+            else
+            {
+                // 检查参数类型
+                for (int k = 0; k < signature->arity; k++)
+                {
+                    Symbol child_formal_type = signature_formal(signature, k);
+                    Symbol parent_formal_type = signature_formal(parent_signature, k);
+                    
+                    if (child_formal_type != parent_formal_type)
+                    {
+                        semant_error(c, DIAG_OVERRIDE_FORMAL, method_name, child_formal_type, parent_formal_type);
+                    }
+                }
+            }
+            
+            // 检查返回类型
+            Symbol parent_return_type = parent_signature->return_type;
+            if (return_type != Err_type && return_type != parent_return_type)
+            {
+                semant_error(c, DIAG_OVERRIDE_RETURN, method_name, return_type, parent_return_type);
+            }
+        }
+    }
+    
+    finish_feature(result, feature - class_table.feature_begin[id]);
+}
+
+void ClassChecker::type_check_class(ClassId id, ClassCheckResult& result)
+{
+    check_attributes(id, result);
+    
+    for (int i = class_table.feature_begin[id]; i < class_table.feature_end[id]; i++)
+    {
+        if (class_table.feature_signature[i] >= 0)
+        {
+            check_method(id, i, result);
+        }
+    }
+}
+
+//////////////////////////////////////////////////////////////////////
+// 增量检查：指纹与类摘要
+//
+// 类的指纹覆盖类的全部内容（包括行号，因为错误输出中有行号）；
+// 接口指纹只覆盖其他类检查时能看到的部分：在继承树中的位置和
+// 方法签名，并且包含父类的接口指纹，祖先的变化会传到所有后代。
+// 一个类的检查结果只取决于它自己的内容和它查询过的类的接口，
+// 两者都没有变化时可以复用上次的错误输出和表达式类型。
+//////////////////////////////////////////////////////////////////////
+
+// 64位FNV-1a
+static const uint64_t FINGERPRINT_SEED = 14695981039346656037ull;
+static const uint64_t FINGERPRINT_PRIME = 1099511628211ull;
+
+static uint64_t hash_combine(uint64_t h, uint64_t value)
+{
+    for (int i = 0; i < 8; i++)
+    {
+        h ^= (value >> (i * 8)) & 0xff;
+        h *= FINGERPRINT_PRIME;
+    }
+    return h;
+}
+
+static uint64_t hash_symbol(uint64_t h, Symbol symbol)
+{
+    if (symbol == NULL) return hash_combine(h, 0);
+    
+    // 按字符串内容计算，不依赖符号表中的地址
+    for (const char* str = symbol->get_string(); *str; str++)
+    {
+        h ^= (unsigned char)*str;
+        h *= FINGERPRINT_PRIME;
+    }
+    return hash_combine(h, symbol->get_len());
+}
+
+// 单个表达式节点的种类、行号和节点自身的符号；子节点的数量也计入，
+// 这样先序序列可以唯一确定树的形状
+static uint64_t hash_expression_node(uint64_t h, Expression expr)
+{
+    ExprKind kind = expr_kind(expr);
+    h = hash_combine(h, kind);
+    h = hash_combine(h, expr->get_line_number());
+    
+    switch (kind)
+    {
+    case EXPR_ASSIGN:
+        h = hash_symbol(h, ((assign_class*)expr)->get_name());
+        break;
+    case EXPR_STATIC_DISPATCH:
+        h = hash_symbol(h, ((static_dispatch_class*)expr)->get_type_name());
+        h = hash_symbol(h, ((static_dispatch_class*)expr)->get_name());
+        h = hash_combine(h, ((static_dispatch_class*)expr)->get_actuals()->len());
+        break;
+    case EXPR_DISPATCH:
+        h = hash_symbol(h, ((dispatch_class*)expr)->get_name());
+        h = hash_combine(h, ((dispatch_class*)expr)->get_actuals()->len());
+        break;
+    case EXPR_TYPCASE:
+    {
+        Cases cases = ((typcase_class*)expr)->get_cases();
+        h = hash_combine(h, cases->len());
+        for(int i = cases->first(); cases->more(i); i = cases->next(i))
+        {
+            branch_class* branch = (branch_class*)cases->nth(i);
+            h = hash_combine(h, branch->get_line_number());
+            h = hash_symbol(h, branch->get_name());
+            h = hash_symbol(h, branch->get_type_decl());
+        }
+        break;
+    }
+    case EXPR_BLOCK:
+        h = hash_combine(h, ((block_class*)expr)->get_body()->len());
+        break;
+    case EXPR_LET:
+        h = hash_symbol(h, ((let_class*)expr)->get_identifier());
+        h = hash_symbol(h, ((let_class*)expr)->get_type_decl());
+        break;
+    case EXPR_INT_CONST:
+        h = hash_symbol(h, ((int_const_class*)expr)->get_token());
+        break;
+    case EXPR_BOOL_CONST:
+        h = hash_combine(h, ((bool_const_class*)expr)->get_val());
+        break;
+    case EXPR_STRING_CONST:
+        h = hash_symbol(h, ((string_const_class*)expr)->get_token());
+        break;
+    case EXPR_NEW:
+        h = hash_symbol(h, ((new__class*)expr)->get_type_name());
+        break;
+    case EXPR_OBJECT:
+        h = hash_symbol(h, ((object_class*)expr)->get_name());
+        break;
+    default:
+        break;
+    }
+    return h;
+}
+
+// 按先序依次计入root子树中的所有节点
+static uint64_t hash_expression(uint64_t h, NodeId root, const ExprIndex& index)
+{
+    for (NodeId id = root; id < index.subtree_end(root); id++)
+    {
+        h = hash_expression_node(h, index.node(id));
+    }
+    return h;
+}
+
+uint64_t FrozenClassTable::class_fingerprint(ClassId id) const
+{
+    Class_ c = class_nodes[id];
+    uint64_t h = FINGERPRINT_SEED;
+    h = hash_symbol(h, c->get_name());
+    h = hash_symbol(h, c->get_parent());
+    h = hash_symbol(h, c->get_filename());
+    h = hash_combine(h, c->get_line_number());
+    
+    for (int i = feature_begin[id]; i < feature_end[id]; i++)
+    {
+        if (feature_signature[i] < 0)
+        {
+            attr_class* attr = (attr_class*)class_features[i];
+            h = hash_combine(h, 'A');
+            h = hash_combine(h, attr->get_line_number());
+            h = hash_symbol(h, attr->get_name());
+            h = hash_symbol(h, attr->get_type());
+            h = hash_expression(h, feature_expr[i], expr_index);
+        }
+        else
+        {
+            method_class* method = (method_class*)class_features[i];
+            std::vector<Formal> formals;
+            flatten_list(method->get_formals(), formals);
+            h = hash_combine(h, 'M');
+            h = hash_combine(h, method->get_line_number());
+            h = hash_symbol(h, method->get_name());
+            h = hash_symbol(h, method->get_return_type());
+            h = hash_combine(h, formals.size());
+            for (size_t j = 0; j < formals.size(); j++)
+            {
+                h = hash_combine(h, formals[j]->get_line_number());
+                h = hash_symbol(h, formals[j]->get_name());
+                h = hash_symbol(h, formals[j]->get_type());
+            }
+            h = hash_expression(h, feature_expr[i], expr_index);
+        }
+    }
+    return h;
+}
+
+void FrozenClassTable::interface_fingerprints(std::vector<uint64_t>& hashes) const
+{
+    // 不在继承树中的名字为0
+    hashes.assign(class_nodes.size(), 0);
+    
+    // 先序遍历，父类的接口指纹先于子类算出
+    for (size_t i = 0; i < euler_tour.size(); i++)
+    {
+        ClassId id = euler_tour[i];
+        if (class_euler[id] != (int)i) continue;
+        
+        uint64_t h = class_parent[id] != NO_CLASS_ID ? hashes[class_parent[id]] : FINGERPRINT_SEED;
+        h = hash_symbol(h, class_names[id]);
+        h = hash_combine(h, class_flags[id]);
+        for (int j = feature_begin[id]; j < feature_end[id]; j++)
+        {
+            // 属性对子类可见：子类的属性环境包含继承的属性
+            if (feature_signature[j] < 0)
+            {
+                attr_class* attr = (attr_class*)class_features[j];
+                h = hash_symbol(h, attr->get_name());
+                h = hash_symbol(h, attr->get_type());
+                continue;
+            }
+            
+            const MethodSignature* signature = &signatures[feature_signature[j]];
+            h = hash_symbol(h, ((method_class*)class_features[j])->get_name());
+            h = hash_combine(h, signature->arity);
+            for (int k = 0; k < signature->arity; k++)
+            {
+                h = hash_symbol(h, signature_formal(signature, k));
+            }
+            h = hash_symbol(h, signature->return_type);
+        }
+        hashes[id] = h;
+    }
+}
+
+// 上一次检查保留的类摘要：类名 -> 摘要；批量检查时多个程序同时访问，
+// 由class_summaries_lock保护
+static std::unordered_map<Symbol, ClassSummary> class_summaries;
+static std::mutex class_summaries_lock;
+
+// 名字当前的接口指纹，不是类名时为0
+static uint64_t interface_of(const FrozenClassTable& table, const std::vector<uint64_t>& interfaces, Symbol name)
+{
+    ClassId id = table.class_id(name);
+    return id == NO_CLASS_ID ? 0 : interfaces[id];
+}
+
+static bool reuse_summary(const FrozenClassTable& table,
+                          ClassId id,
+                          uint64_t fingerprint,
+                          const std::vector<uint64_t>& interfaces,
+                          ExprTypes& types,
+                          ClassCheckResult& result)
+{
+    Class_ c = table.get_class(id);
+    std::lock_guard<std::mutex> guard(class_summaries_lock);
+    std::unordered_map<Symbol, ClassSummary>::const_iterator it = class_summaries.find(c->get_name());
+    if (it == class_summaries.end()) return false;
+    
+    const ClassSummary& summary = it->second;
+    if (summary.fingerprint != fingerprint) return false;
+    for (size_t i = 0; i < summary.dependencies.size(); i++)
+    {
+        if (interface_of(table, interfaces, summary.dependencies[i].first) != summary.dependencies[i].second)
+            return false;
+    }
+    
+    if (semant_debug) {
+        cerr << "增量检查: 复用类 " << c->get_name() << endl;
+    }
+    
+    // 复用诊断信息和类型；类的表达式编号连续，与摘要中的先序一一对应
+    result.feature_diagnostics = summary.feature_diagnostics;
+    
+    NodeId begin = table.expressions_begin(id);
+    for (NodeId k = begin; k < table.expressions_end(id); k++)
+    {
+        types.set(k, summary.types[k - begin]);
+    }
+    return true;
+}
+
+static void save_summary(const FrozenClassTable& table,
+                         ClassId id,
+                         uint64_t fingerprint,
+                         const std::vector<uint64_t>& interfaces,
+                         const ExprTypes& types,
+                         const ClassCheckResult& result)
+{
+    Class_ c = table.get_class(id);
+    std::lock_guard<std::mutex> guard(class_summaries_lock);
+    ClassSummary& summary = class_summaries[c->get_name()];
+    summary.fingerprint = fingerprint;
+    
+    // 依赖：本类（继承树中的位置）和所有特性查询过的类名
+    std::vector<Symbol> names(1, c->get_name());
+    for (size_t i = 0; i < result.feature_uses.size(); i++)
+    {
+        names.insert(names.end(), result.feature_uses[i].begin(), result.feature_uses[i].end());
+    }
+    std::sort(names.begin(), names.end());
+    names.erase(std::unique(names.begin(), names.end()), names.end());
+    
+    summary.dependencies.clear();
+    for (size_t i = 0; i < names.size(); i++)
+    {
+        summary.dependencies.push_back(std::make_pair(names[i], interface_of(table, interfaces, names[i])));
+    }
+    
+    summary.feature_diagnostics = result.feature_diagnostics;
+    
+    NodeId begin = table.expressions_begin(id);
+    summary.types.resize(table.expressions_end(id) - begin);
+    for (size_t i = 0; i < summary.types.size(); i++)
+    {
+        summary.types[i] = types.get(begin + i);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////
+// 类摘要缓存
+//
+// 缓存文件保存事先检查过的类的摘要：父类、属性类型和方法签名。
+// 载入时整个文件被映射到内存，校验后为每个类构造一个没有方法体的
+// AST节点（与基本类相同），这些类不再进行类型检查。
+//
+// 文件布局：CacheHeader，然后依次是类、特性、参数记录和字符串区；
+// 记录中的字符串都是字符串区中以'\0'结尾的字符串的偏移。
+// 头部的校验和覆盖头部之后的全部内容，格式改变时增加版本号。
+//////////////////////////////////////////////////////////////////////
+
+static const char CLASS_CACHE_MAGIC[8] = { 'C', 'O', 'O', 'L', 'S', 'U', 'M', '\0' };
+static const uint32_t CLASS_CACHE_VERSION = 1;
+
+struct CacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t class_count;
+    uint32_t feature_count;
+    uint32_t formal_count;
+    uint32_t string_size;                  // 字符串区的字节数
+    uint32_t reserved;
+    uint64_t checksum;                     // 头部之后全部内容的指纹
+};
+
+struct CacheClass {
+    uint32_t name;
+    uint32_t parent;
+    uint32_t filename;
+    uint32_t feature_begin;                // 特性记录的区间
+    uint32_t feature_count;
+};
+
+struct CacheFeature {
+    uint32_t is_method;                    // 1为方法，0为属性
+    uint32_t name;
+    uint32_t type;                         // 属性类型或方法返回类型
+    uint32_t formal_begin;                 // 方法参数记录的区间
+    uint32_t formal_count;
+};
+
+struct CacheFormal {
+    uint32_t name;
+    uint32_t type;
+};
+
+static uint64_t hash_bytes(uint64_t h, const char* data, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        h ^= (unsigned char)data[i];
+        h *= FINGERPRINT_PRIME;
+    }
+    return h;
+}
+
+// 写缓存时的字符串区，相同的字符串只存一次
+class CacheStrings {
+private:
+    std::string data;
+    std::unordered_map<Symbol, uint32_t> offsets;
+    
+public:
+    uint32_t add(Symbol symbol) {
+        std::unordered_map<Symbol, uint32_t>::const_iterator it = offsets.find(symbol);
+        if (it != offsets.end()) return it->second;
+        uint32_t offset = data.size();
+        data.append(symbol->get_string());
+        data.push_back('\0');
+        offsets.insert(std::make_pair(symbol, offset));
+        return offset;
+    }
+    const std::string& bytes() const { return data; }
+};
+
+bool FrozenClassTable::write_class_cache(const char* path) const
+{
+    std::vector<CacheClass> classes;
+    std::vector<CacheFeature> features;
+    std::vector<CacheFormal> formals;
+    CacheStrings strings;
+    
+    for (ClassId id = 0; id < class_nodes.size(); id++)
+    {
+        if (!(class_flags[id] & CLASS_DEFINED) || (class_flags[id] & CLASS_BASIC)) continue;
+        
+        Class_ c = class_nodes[id];
+        CacheClass record;
+        record.name = strings.add(c->get_name());
+        record.parent = strings.add(c->get_parent());
+        record.filename = strings.add(c->get_filename());
+        record.feature_begin = features.size();
+        record.feature_count = feature_end[id] - feature_begin[id];
+        classes.push_back(record);
+        
+        for (int i = feature_begin[id]; i < feature_end[id]; i++)
+        {
+            CacheFeature feature;
+            if (feature_signature[i] < 0)
+            {
+                attr_class* attr = (attr_class*)class_features[i];
+                feature.is_method = 0;
+                feature.name = strings.add(attr->get_name());
+                feature.type = strings.add(attr->get_type());
+                feature.formal_begin = formals.size();
+                feature.formal_count = 0;
+            }
+            else
+            {
+                method_class* method = (method_class*)class_features[i];
+                Formals method_formals = method->get_formals();
+                feature.is_method = 1;
+                feature.name = strings.add(method->get_name());
+                feature.type = strings.add(method->get_return_type());
+                feature.formal_begin = formals.size();
+                feature.formal_count = method_formals->len();
+                for(int j = method_formals->first(); method_formals->more(j); j = method_formals->next(j))
+                {
+                    CacheFormal formal;
+                    formal.name = strings.add(method_formals->nth(j)->get_name());
+                    formal.type = strings.add(method_formals->nth(j)->get_type());
+                    formals.push_back(formal);
+                }
+            }
+            features.push_back(feature);
+        }
+    }
+    
+    CacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CLASS_CACHE_MAGIC, sizeof(header.magic));
+    header.version = CLASS_CACHE_VERSION;
+    header.class_count = classes.size();
+    header.feature_count = features.size();
+    header.formal_count = formals.size();
+    header.string_size = strings.bytes().size();
+    
+    uint64_t h = FINGERPRINT_SEED;
+    h = hash_bytes(h, (const char*)classes.data(), classes.size() * sizeof(CacheClass));
+    h = hash_bytes(h, (const char*)features.data(), features.size() * sizeof(CacheFeature));
+    h = hash_bytes(h, (const char*)formals.data(), formals.size() * sizeof(CacheFormal));
+    h = hash_bytes(h, strings.bytes().data(), strings.bytes().size());
+    header.checksum = h;
+    
+    std::ofstream out(path, std::ios::out | std::ios::binary | std::ios::trunc);
+    out.write((const char*)&header, sizeof(header));
+    out.write((const char*)classes.data(), classes.size() * sizeof(CacheClass));
+    out.write((const char*)features.data(), features.size() * sizeof(CacheFeature));
+    out.write((const char*)formals.data(), formals.size() * sizeof(CacheFormal));
+    out.write(strings.bytes().data(), strings.bytes().size());
+    out.close();
+    return !out.fail();
+}
+
+// 映射到内存的缓存文件
+class MappedClassCache {
+private:
+    const char* data;
+    size_t size;
+    
+    const CacheHeader* header;
+    const CacheClass* classes;
+    const CacheFeature* features;
+    const CacheFormal* formals;
+    const char* strings;
+    
+    bool valid_string(uint32_t offset) const {
+        return offset < header->string_size &&
+            memchr(strings + offset, '\0', header->string_size - offset) != NULL;
+    }
+    
+public:
+    MappedClassCache() : data(NULL), size(0), header(NULL) {}
+    ~MappedClassCache() { if (data != NULL) munmap((void*)data, size); }
+    
+    // 映射并校验文件，失败时返回错误原因，成功返回NULL
+    const char* open(const char* path);
+    
+    uint32_t class_count() const { return header->class_count; }
+    const CacheClass& cached_class(uint32_t k) const { return classes[k]; }
+    const CacheFeature& feature(uint32_t k) const { return features[k]; }
+    const CacheFormal& formal(uint32_t k) const { return formals[k]; }
+    const char* string(uint32_t offset) const { return strings + offset; }
+};
+
+const char* MappedClassCache::open(const char* path)
+{
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0) return "cannot open file";
+    
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(CacheHeader))
+    {
+        close(fd);
+        return "file too short";
+    }
+    
+    void* mapped = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) return "cannot map file";
+    data = (const char*)mapped;
+    size = st.st_size;
+    
+    // 检查头部
+    header = (const CacheHeader*)data;
+    if (memcmp(header->magic, CLASS_CACHE_MAGIC, sizeof(header->magic)) != 0) return "not a class cache";
+    if (header->version != CLASS_CACHE_VERSION) return "unsupported version";
+    
+    uint64_t expected = (uint64_t)sizeof(CacheHeader)
+        + (uint64_t)header->class_count * sizeof(CacheClass)
+        + (uint64_t)header->feature_count * sizeof(CacheFeature)
+        + (uint64_t)header->formal_count * sizeof(CacheFormal)
+        + header->string_size;
+    if (expected != size) return "truncated file";
+    
+    classes = (const CacheClass*)(data + sizeof(CacheHeader));
+    features = (const CacheFeature*)(classes + header->class_count);
+    formals = (const CacheFormal*)(features + header->feature_count);
+    strings = (const char*)(formals + header->formal_count);
+    
+    if (hash_bytes(FINGERPRINT_SEED, data + sizeof(CacheHeader), size - sizeof(CacheHeader)) != header->checksum)
+        return "checksum mismatch";
+    
+    // 检查所有区间和字符串偏移，之后的读取不再检查
+    for (uint32_t k = 0; k < header->class_count; k++)
+    {
+        const CacheClass& c = classes[k];
+        if (!valid_string(c.name) || !valid_string(c.parent) || !valid_string(c.filename) ||
+            (uint64_t)c.feature_begin + c.feature_count > header->feature_count)
+            return "corrupt class record";
+    }
+    for (uint32_t k = 0; k < header->feature_count; k++)
+    {
+        const CacheFeature& f = features[k];
+        if (!valid_string(f.name) || !valid_string(f.type) ||
+            (uint64_t)f.formal_begin + f.formal_count > header->formal_count)
+            return "corrupt feature record";
+    }
+    for (uint32_t k = 0; k < header->formal_count; k++)
+    {
+        if (!valid_string(formals[k].name) || !valid_string(formals[k].type))
+            return "corrupt formal record";
+    }
+    return NULL;
+}
+
+// 缓存中的类的AST节点，与基本类一样在进程中只构造一次
+static std::vector<Class_> cached_class_nodes;
+
+static void load_cached_classes(void)
+{
+    MappedClassCache cache;
+    const char* problem = cache.open(semant_class_cache);
+    if (problem != NULL)
+    {
+        cerr << "semant: ignoring class cache " << semant_class_cache << ": " << problem << endl;
+        return;
+    }
+    
+    for (uint32_t k = 0; k < cache.class_count(); k++)
+    {
+        const CacheClass& record = cache.cached_class(k);
+        
+        // 与基本类一样构造没有方法体的AST节点
+        Features features = nil_Features();
+        for (uint32_t i = record.feature_begin; i < record.feature_begin + record.feature_count; i++)
+        {
+            const CacheFeature& f = cache.feature(i);
+            Symbol name = idtable.add_string((char*)cache.string(f.name));
+            Symbol type = idtable.add_string((char*)cache.string(f.type));
+            Feature feature;
+            if (f.is_method)
+            {
+                Formals formals = nil_Formals();
+                for (uint32_t j = f.formal_begin; j < f.formal_begin + f.formal_count; j++)
+                {
+                    const CacheFormal& formal_record = cache.formal(j);
+                    formals = append_Formals(formals,
+                                             single_Formals(formal(idtable.add_string((char*)cache.string(formal_record.name)),
+                                                                   idtable.add_string((char*)cache.string(formal_record.type)))));
+                }
+                feature = method(name, formals, type, no_expr());
+            }
+            else
+            {
+                feature = attr(name, type, no_expr());
+            }
+            features = append_Features(features, single_Features(feature));
+        }
+        
+        cached_class_nodes.push_back(class_(idtable.add_string((char*)cache.string(record.name)),
+                                            idtable.add_string((char*)cache.string(record.parent)),
+                                            features,
+                                            stringtable.add_string((char*)cache.string(record.filename))));
+    }
+}
+
+void ClassTable::install_cached_classes()
+{
+    static std::once_flag loaded;
+    std::call_once(loaded, load_cached_classes);
+    
+    for (size_t k = 0; k < cached_class_nodes.size(); k++)
+    {
+        Class_ c = cached_class_nodes[k];
+        Symbol name = c->get_name();
+        if (semant_debug) {
+            cerr << "从缓存安装类: " << name << endl;
+        }
+        
+        if (is_defined(name))
+        {
+            semant_error(c, DIAG_CLASS_REDEFINED, name);
+            continue;
+        }
+        add_class(c, CLASS_CACHED);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////
+// 跟踪（只在定义SEMANT_TRACE时编译）
+//////////////////////////////////////////////////////////////////////
+
+#ifdef SEMANT_TRACE
+
+// 每个线程的环形缓冲区保留的事件数，必须是2的幂
+static const size_t TRACE_RING_SIZE = 1 << 16;
+
+struct TraceRecord {
+    uint64_t time;
+    uint32_t thread;
+    TraceKind kind;
+    int value;
+    Symbol a;
+    Symbol b;
+};
+
+// 一个线程的环形缓冲区；线程结束后放入空闲列表，由之后的新线程接着使用，
+// 其中的事件保留到被覆盖或写出为止
+struct TraceRing {
+    std::vector<TraceRecord> records;
+    uint64_t next;                         // 写入过的事件总数
+    TraceRing() : records(TRACE_RING_SIZE), next(0) {}
+};
+
+static const std::chrono::steady_clock::time_point trace_start = std::chrono::steady_clock::now();
+static std::mutex trace_lock;              // 保护以下两个列表
+static std::vector<TraceRing*> trace_rings;
+static std::vector<TraceRing*> free_trace_rings;
+static std::atomic<uint32_t> trace_threads(0);
+
+// 每个线程第一次记录事件时取得一个缓冲区
+struct TraceThread {
+    TraceRing* ring;
+    uint32_t thread;
+    
+    TraceThread() : ring(NULL), thread(trace_threads++)
+    {
+        std::lock_guard<std::mutex> guard(trace_lock);
+        if (free_trace_rings.empty())
+        {
+            ring = new TraceRing();
+            trace_rings.push_back(ring);
+        }
+        else
+        {
+            ring = free_trace_rings.back();
+            free_trace_rings.pop_back();
+        }
+    }
+    
+    ~TraceThread()
+    {
+        std::lock_guard<std::mutex> guard(trace_lock);
+        free_trace_rings.push_back(ring);
+    }
+};
+
+void semant_trace(TraceKind kind, int value, Symbol a, Symbol b)
+{
+    static thread_local TraceThread current;
+    TraceRecord& record = current.ring->records[current.ring->next++ & (TRACE_RING_SIZE - 1)];
+    record.time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - trace_start).count();
+    record.thread = current.thread;
+    record.kind = kind;
+    record.value = value;
+    record.a = a;
+    record.b = b;
+}
+
+// 进程退出时把所有缓冲区中的事件按时间顺序写入semant_trace_file
+static void write_trace_file()
+{
+    std::lock_guard<std::mutex> guard(trace_lock);
+    std::vector<TraceFileEvent> events;
+    CacheStrings strings;
+    for (size_t r = 0; r < trace_rings.size(); r++)
+    {
+        const TraceRing* ring = trace_rings[r];
+        uint64_t first = ring->next > TRACE_RING_SIZE ? ring->next - TRACE_RING_SIZE : 0;
+        for (uint64_t i = first; i < ring->next; i++)
+        {
+            const TraceRecord& record = ring->records[i & (TRACE_RING_SIZE - 1)];
+            TraceFileEvent event;
+            event.time = record.time;
+            event.thread = record.thread;
+            event.kind = record.kind;
+            event.value = record.value;
+            event.a = record.a == NULL ? TRACE_NO_SYMBOL : strings.add(record.a);
+            event.b = record.b == NULL ? TRACE_NO_SYMBOL : strings.add(record.b);
+            event.reserved = 0;
+            events.push_back(event);
+        }
+    }
+    std::stable_sort(events.begin(), events.end(), [](const TraceFileEvent& x, const TraceFileEvent& y) {
+        return x.time < y.time;
+    });
+    
+    TraceFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_FILE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_FILE_VERSION;
+    header.thread_count = trace_threads;
+    header.event_count = events.size();
+    header.string_size = strings.bytes().size();
+    
+    std::ofstream out(semant_trace_file, std::ios::out | std::ios::binary | std::ios::trunc);
+    out.write((const char*)&header, sizeof(header));
+    out.write((const char*)events.data(), events.size() * sizeof(TraceFileEvent));
+    out.write(strings.bytes().data(), strings.bytes().size());
+    out.close();
+    if (!out)
+    {
+        cerr << "semant: cannot write trace " << semant_trace_file << endl;
+    }
+}
+
+#endif
+
+//////////////////////////////////////////////////////////////////////
+// 整体类型检查
+//////////////////////////////////////////////////////////////////////
+
+void ClassTable::type_check(int jobs, CheckerCounters* counters)
+{
+    freeze()->type_check(diagnostics, jobs, expr_types, counters);
+}
+
+int FrozenClassTable::type_check(Diagnostics& diagnostics, int jobs, ExprTypes& types,
+                                 CheckerCounters* counters) const
+{
+    if (semant_debug) {
+        cerr << "开始类型检查" << endl;
+    }
+    
+    // 检查器读写编号的类型表，不再直接修改AST
+    types.load(expr_index);
+    
+    // 按编号收集所有有定义的类
+    std::vector<ClassId> defined;
+    for (ClassId id = 0; id < class_nodes.size(); id++)
+    {
+        // 基本类没有方法体，缓存中的类在写入缓存时已经检查过
+        if ((class_flags[id] & CLASS_DEFINED) && !(class_flags[id] & (CLASS_BASIC | CLASS_CACHED)))
+        {
+            defined.push_back(id);
+        }
+    }
+    
+    // 每个类的检查结果，完成后按编号和特性顺序合并
+    std::vector<ClassCheckResult> results(defined.size());
+    
+    // 所有检查器共用的错误数和停止标志，用于--max-errors
+    std::atomic<int> error_count(0);
+    std::atomic<bool> stopped(false);
+    
+    // 增量检查：内容和依赖的类都没有变化的类直接复用上次的结果
+    std::vector<char> reused(defined.size(), 0);
+    std::vector<uint64_t> fingerprints(defined.size(), 0);
+    std::vector<uint64_t> interfaces;
+    if (semant_incremental)
+    {
+        interface_fingerprints(interfaces);
+        for (size_t k = 0; k < defined.size(); k++)
+        {
+            fingerprints[k] = class_fingerprint(defined[k]);
+            reused[k] = reuse_summary(*this, defined[k], fingerprints[k], interfaces, types, results[k]);
+            for (size_t f = 0; reused[k] && f < results[k].feature_diagnostics.size(); f++)
+            {
+                error_count += results[k].feature_diagnostics[f].count();
+            }
+        }
+    }
+    
+    if (jobs <= 1)
+    {
+        ClassChecker checker(*this, types, semant_incremental, &error_count, &stopped, counters != NULL);
+        for (size_t k = 0; k < defined.size(); k++)
+        {
+            if (reused[k]) continue;
+            checker.type_check_class(defined[k], results[k]);
+        }
+        if (counters != NULL) checker.add_counters(*counters);
+    }
+    else
+    {
+        if (semant_debug) {
+            cerr << "并行类型检查: " << jobs << " 个线程" << endl;
+        }
+        
+        // 每个工作线程一个检查器；类表此时只读，每个任务只写
+        // 自己类的结果中对应特性的槽位和该特性表达式编号的类型
+        TaskPool pool(jobs);
+        std::deque<ClassChecker> checkers;
+        for (int t = 0; t < pool.workers(); t++)
+        {
+            checkers.emplace_back(*this, types, semant_incremental, &error_count, &stopped, counters != NULL);
+        }
+        
+        // 每个类一个任务：检查属性后，把每个方法作为单独的任务放入
+        // 当前线程的队列，空闲的线程会把它们窃取走
+        for (size_t k = 0; k < defined.size(); k++)
+        {
+            if (reused[k]) continue;
+            pool.push(k % pool.workers(), [this, &pool, &checkers, &results, &defined, k](int worker) {
+                ClassId id = defined[k];
+                checkers[worker].check_attributes(id, results[k]);
+                for (int i = feature_begin[id]; i < feature_end[id]; i++)
+                {
+                    if (feature_signature[i] < 0) continue;
+                    pool.push(worker, [&checkers, &results, id, i, k](int worker) {
+                        checkers[worker].check_method(id, i, results[k]);
+                    });
+                }
+            });
+        }
+        pool.run();
+        
+        for (size_t t = 0; counters != NULL && t < checkers.size(); t++)
+        {
+            checkers[t].add_counters(*counters);
+        }
+    }
+    
+    // 保存重新检查的类的摘要，供下一次检查使用；有错误被丢弃时
+    // 检查没有完成，结果不能复用
+    if (stopped) diagnostics.mark_stopped();
+    if (semant_incremental && !stopped)
+    {
+        for (size_t k = 0; k < defined.size(); k++)
+        {
+            if (reused[k]) continue;
+            save_summary(*this, defined[k], fingerprints[k], interfaces, types, results[k]);
+        }
+    }
+    
+    // 所有检查器都已结束，把推断的类型一次写回AST
+    types.publish(expr_index);
+    
+    // 按类的编号（即源程序顺序）和特性顺序合并诊断信息，
+    // 设置了--max-errors时只保留前面的记录
+    int merged = diagnostics.count();
+    for (size_t k = 0; k < results.size(); k++)
+    {
+        for (size_t f = 0; f < results[k].feature_diagnostics.size(); f++)
+        {
+            diagnostics.append(results[k].feature_diagnostics[f]);
+        }
+    }
+    if (semant_max_errors > 0 && diagnostics.count() > semant_max_errors)
+    {
+        diagnostics.truncate(semant_max_errors);
+    }
+    return diagnostics.count() - merged;
+}
+
+//////////////////////////////////////////////////////////////////////
+// 工作窃取线程池（TaskPool）实现
+//////////////////////////////////////////////////////////////////////
+
+TaskPool::TaskPool(int workers) : queues(workers), pending(0), queued(0)
+{
+}
+
+void TaskPool::push(int worker, const Task& task)
+{
+    // 先计数再入队，保证执行中的任务放入的新任务不会被漏等
+    pending++;
+    {
+        Queue& queue = queues[worker];
+        std::lock_guard<std::mutex> guard(queue.lock);
+        queue.tasks.push_back(task);
+    }
+    queued++;
+    wake_idle(false);
+}
+
+bool TaskPool::take(int worker, Task& task)
+{
+    // 先从自己队列的队尾取，刚放入的方法任务与当前类的数据最接近
+    {
+        Queue& own = queues[worker];
+        std::lock_guard<std::mutex> guard(own.lock);
+        if (!own.tasks.empty())
+        {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            queued--;
+            return true;
+        }
+    }
+    
+    // 再从其他队列的队首窃取，那里是最早放入、通常也最大的任务
+    for (size_t k = 1; k < queues.size(); k++)
+    {
+        Queue& victim = queues[(worker + k) % queues.size()];
+        std::lock_guard<std::mutex> guard(victim.lock);
+        if (!victim.tasks.empty())
+        {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            queued--;
+            return true;
+        }
+    }
+    return false;
+}
+
+void TaskPool::wake_idle(bool all)
+{
+    // 计数已经修改；取一次锁，使正在检查条件的线程要么看到新的计数，
+    // 要么已经进入等待、能收到通知
+    {
+        std::lock_guard<std::mutex> guard(idle_lock);
+    }
+    if (all)
+        idle.notify_all();
+    else
+        idle.notify_one();
+}
+
+void TaskPool::work(int worker)
+{
+    Task task;
+    while (pending > 0)
+    {
+        if (take(worker, task))
+        {
+            task(worker);
+            if (--pending == 0) wake_idle(true);
+        }
+        else
+        {
+            // 没有可取的任务：等到有新任务放入或全部任务完成
+            std::unique_lock<std::mutex> guard(idle_lock);
+            idle.wait(guard, [this] { return pending == 0 || queued > 0; });
+        }
+    }
+}
+
+void TaskPool::run()
+{
+    // 当前线程作为0号工作线程
+    std::vector<std::thread> threads;
+    for (int t = 1; t < workers(); t++)
+    {
+        threads.push_back(std::thread(&TaskPool::work, this, t));
+    }
+    work(0);
+    for (size_t t = 0; t < threads.size(); t++)
+    {
+        threads[t].join();
+    }
+}
+
+//////////////////////////////////////////////////////////////////////
+// 命令行选项
+//////////////////////////////////////////////////////////////////////
+
+// 识别语义分析器共用的选项，设置对应的全局变量后从argv中删去：
+//   -j N、-jN                  类型检查（semant-server --batch时为同时检查的程序）的线程数
+//   --incremental              在同一进程中复用未变化的类的检查结果
+//   --class-cache FILE         安装类摘要缓存中的类
+//   --write-class-cache FILE   检查通过后写出类摘要缓存
+//   --max-errors N             记录N个错误后停止检查
+//   --diagnostics-json         诊断信息以JSON数组输出
+//   --stats FILE               退出时把各阶段耗时和计数写入FILE
+//   --trace FILE               退出时写出跟踪（需要用-DSEMANT_TRACE编译）
+// 其余参数（例如semant-server的--batch和--socket PATH）保持原顺序留给调用者
+void handle_semant_flags(int *argc, char *argv[])
+{
+    int kept = 1;
+    for (int i = 1; i < *argc; i++)
+    {
+        const char* value = NULL;
+        if (strcmp(argv[i], "--incremental") == 0)
+        {
+            semant_incremental = true;
+            continue;
+        }
+        else if (strcmp(argv[i], "--diagnostics-json") == 0)
+        {
+            semant_diagnostics_json = true;
+            continue;
+        }
+        else if (strcmp(argv[i], "--max-errors") == 0 && i + 1 < *argc)
+        {
+            semant_max_errors = atoi(argv[++i]);
+            continue;
+        }
+        else if (strcmp(argv[i], "--stats") == 0 && i + 1 < *argc)
+        {
+            if (semant_stats_file == NULL) atexit(write_stats_file);
+            semant_stats_file = argv[++i];
+            continue;
+        }
+        else if (strcmp(argv[i], "--trace") == 0 && i + 1 < *argc)
+        {
+#ifdef SEMANT_TRACE
+            if (semant_trace_file == NULL) atexit(write_trace_file);
+#else
+            cerr << "semant: built without SEMANT_TRACE, --trace ignored" << endl;
+#endif
+            semant_trace_file = argv[++i];
+            continue;
+        }
+        else if (strcmp(argv[i], "--class-cache") == 0 && i + 1 < *argc)
+        {
+            semant_class_cache = argv[++i];
+            continue;
+        }
+        else if (strcmp(argv[i], "--write-class-cache") == 0 && i + 1 < *argc)
+        {
+            semant_write_class_cache = argv[++i];
+            continue;
+        }
+        else if (strcmp(argv[i], "-j") == 0 && i + 1 < *argc)
+        {
+            value = argv[++i];
+        }
+        else if (strncmp(argv[i], "-j", 2) == 0 && argv[i][2] != '\0')
+        {
+            value = argv[i] + 2;
+        }
+        else
+        {
+            argv[kept++] = argv[i];
+            continue;
+        }
+        
+        semant_jobs = atoi(value);
+        if (semant_jobs <= 0)
+        {
+            // -j 0：使用所有硬件线程
+            semant_jobs = std::thread::hardware_concurrency();
+            if (semant_jobs <= 0) semant_jobs = 1;
+        }
+    }
+    argv[kept] = NULL;
+    *argc = kept;
+}
+
+//////////////////////////////////////////////////////////////////////
+// 输出格式：类型标注的AST
+//////////////////////////////////////////////////////////////////////
+
+// 缩进用的空格；与pad相同，超过80列的缩进按80列输出
+static const int MAX_INDENT = 80;
+static const char INDENT_SPACES[MAX_INDENT + 1] =
+    "                                                                                ";
+
+static inline char* put_indent(char* p, int indent)
+{
+    if (indent > MAX_INDENT) indent = MAX_INDENT;
+    if (indent > 0)
+    {
+        memcpy(p, INDENT_SPACES, indent);
+        p += indent;
+    }
+    return p;
+}
+
+// 当前块放不下时换一块新的；已经写满的块不再移动
+char* TypedAstWriter::add_chunk(size_t n)
+{
+    if (!chunks.empty())
     {
-        // 静态分派表达式
-        static_dispatch_class* static_dispatch_expr = (static_dispatch_class*)expr;
-        
-        // 检查类型名称
-        Symbol static_type = static_dispatch_expr->get_type_name();
-        
-        // 检查表达式
-        Expression expr_obj = static_dispatch_expr->get_expr();
-        Symbol expr_type = type_check_expression(expr_obj, current_class, object_env, filename);
-        
-        // 检查类型兼容性
-        if (!is_subtype(expr_type, static_type))
-        {
-            semant_error(filename, expr) << "Expression type " << expr_type 
-                << " does not conform to declared static dispatch type " << static_type << "." << endl;
-            semant_errors++;
-        }
-        
-        // 查找方法
-        method_class* method = find_method(static_type, static_dispatch_expr->get_name());
-        if (method == NULL)
-        {
-            semant_error(filename, expr) << "Dispatch to undefined method " 
-                << static_dispatch_expr->get_name() << "." << endl;
-            semant_errors++;
-            result_type = Object;
-        }
-        else
+        chunks.back().size = chunk_size(chunks.size() - 1);
+    }
+    size_t capacity = n > CHUNK_SIZE ? n : CHUNK_SIZE;
+    Chunk chunk;
+    chunk.data.reset(new char[capacity]);
+    chunk.size = 0;
+    chunks.push_back(std::move(chunk));
+    cursor = chunks.back().data.get();
+    limit = cursor + capacity;
+    return cursor;
+}
+
+void TypedAstWriter::put_text(int indent, const char* text, size_t len)
+{
+    char* p = put_indent(reserve(MAX_INDENT + len + 1), indent);
+    memcpy(p, text, len);
+    p += len;
+    *p++ = '\n';
+    commit(p);
+}
+
+void TypedAstWriter::put_line_number(int indent, int line)
+{
+    // 行号从低位开始写到临时缓冲区的末尾
+    char digits[16];
+    char* end = digits + sizeof(digits);
+    char* q = end;
+    unsigned int value = line < 0 ? -(unsigned int)line : line;
+    do {
+        *--q = '0' + value % 10;
+        value /= 10;
+    } while (value != 0);
+    if (line < 0) *--q = '-';
+    
+    char* p = put_indent(reserve(MAX_INDENT + sizeof(digits) + 2), indent);
+    *p++ = '#';
+    memcpy(p, q, end - q);
+    p += end - q;
+    *p++ = '\n';
+    commit(p);
+}
+
+void TypedAstWriter::put_type(int indent, Symbol type)
+{
+    const char* name = type != NULL ? type->get_string() : "_no_type";
+    size_t len = type != NULL ? type->get_len() : strlen(name);
+    char* p = put_indent(reserve(MAX_INDENT + len + 3), indent);
+    *p++ = ':';
+    *p++ = ' ';
+    memcpy(p, name, len);
+    p += len;
+    *p++ = '\n';
+    commit(p);
+}
+
+// 与print_escaped_string相同的转义：不可打印的字符输出为三位八进制
+void TypedAstWriter::put_string(int indent, const char* s)
+{
+    size_t len = strlen(s);
+    char* p = put_indent(reserve(MAX_INDENT + 4 * len + 3), indent);
+    *p++ = '"';
+    for (; *s; s++)
+    {
+        switch (*s)
         {
-            // 检查参数
-            Expressions actuals = static_dispatch_expr->get_actuals();
-            Formals formals = method->get_formals();
-            
-            int actual_count = 0;
-            for(int i = actuals->first(); actuals->more(i); i = actuals->next(i))
-            {
-                actual_count++;
-            }
-            
-            int formal_count = 0;
-            for(int i = formals->first(); formals->more(i); i = formals->next(i))
-            {
-                formal_count++;
-            }
-            
-            if (actual_count != formal_count)
+        case '\\': *p++ = '\\'; *p++ = '\\'; break;
+        case '\"': *p++ = '\\'; *p++ = '\"'; break;
+        case '\n': *p++ = '\\'; *p++ = 'n';  break;
+        case '\t': *p++ = '\\'; *p++ = 't';  break;
+        case '\b': *p++ = '\\'; *p++ = 'b';  break;
+        case '\f': *p++ = '\\'; *p++ = 'f';  break;
+        default:
+            if (isprint(*s))
             {
-                semant_error(filename, expr) << "Method " << static_dispatch_expr->get_name() 
-                    << " called with wrong number of arguments." << endl;
-                semant_errors++;
+                *p++ = *s;
             }
             else
             {
-                // 检查每个参数的类型
-                int param_index = 0;
-                for(int i = actuals->first(), j = formals->first(); 
-                    actuals->more(i) && formals->more(j); 
-                    i = actuals->next(i), j = formals->next(j))
-                {
-                    Expression actual = actuals->nth(i);
-                    Formal formal = formals->nth(j);
-                    
-                    Symbol actual_type = type_check_expression(actual, current_class, object_env, filename);
-                    Symbol formal_type = formal->get_type();
-                    
-                    if (!is_subtype(actual_type, formal_type))
-                    {
-                        semant_error(filename, expr) << "In call of method " << static_dispatch_expr->get_name() 
-                            << ", type " << actual_type << " of parameter " << param_index 
-                            << " does not conform to declared type " << formal_type << "." << endl;
-                        semant_errors++;
-                    }
-                    
-                    param_index++;
-                }
-            }
-            
-            // 设置返回类型
-            result_type = method->get_return_type();
-            if (result_type == SELF_TYPE)
-            {
-                result_type = static_type;
+                unsigned char c = *s;
+                *p++ = '\\';
+                *p++ = '0' + (c >> 6);
+                *p++ = '0' + ((c >> 3) & 7);
+                *p++ = '0' + (c & 7);
             }
+            break;
         }
-        
-        static_dispatch_expr->set_type(result_type);
     }
-    else if (dynamic_cast<cond_class*>(expr) != NULL)
+    *p++ = '"';
+    *p++ = '\n';
+    commit(p);
+}
+
+void TypedAstWriter::push(Step step, int indent, tree_node* node, int id, Symbol symbol, const char* text)
+{
+    Item item;
+    item.step = step;
+    item.indent = indent;
+    item.node = node;
+    item.id = id;
+    item.symbol = symbol;
+    item.text = text;
+    pending.push_back(item);
+}
+
+template <class Elem>
+void TypedAstWriter::push_list(Step step, int indent, list_node<Elem>* list)
+{
+    std::vector<Elem> elements;
+    flatten_list(list, elements);
+    for (size_t k = elements.size(); k > 0; k--)
     {
-        // 条件表达式
-        cond_class* cond_expr = (cond_class*)expr;
-        
-        // 检查条件表达式
-        Expression pred = cond_expr->get_pred();
-        Symbol pred_type = type_check_expression(pred, current_class, object_env, filename);
-        
-        if (pred_type != Bool)
-        {
-            semant_error(filename, expr) << "Predicate of 'if' does not have type Bool." << endl;
-            semant_errors++;
-        }
-        
-        // 检查then和else分支
-        Expression then_exp = cond_expr->get_then_exp();
-        Expression else_exp = cond_expr->get_else_exp();
-        
-        Symbol then_type = type_check_expression(then_exp, current_class, object_env, filename);
-        Symbol else_type = type_check_expression(else_exp, current_class, object_env, filename);
-        
-        // 计算最小上界作为条件表达式的类型
-        result_type = lub(then_type, else_type);
-        
-        cond_expr->set_type(result_type);
+        push(step, indent, elements[k - 1]);
     }
-    else if (dynamic_cast<loop_class*>(expr) != NULL)
+}
+
+void TypedAstWriter::write_class(const Item& item)
+{
+    Class_ c = (Class_)item.node;
+    int indent = item.indent;
+    put_line_number(indent, c->get_line_number());
+    put_text(indent, "_class", 6);
+    put_symbol(indent + 2, c->get_name());
+    put_symbol(indent + 2, c->get_parent());
+    put_string(indent + 2, c->get_filename()->get_string());
+    put_text(indent + 2, "(", 1);
+    
+    push(STEP_TEXT, indent + 2, NULL, -1, NULL, ")");
+    if (item.id < 0)
     {
-        // 循环表达式
-        loop_class* loop_expr = (loop_class*)expr;
-        
-        // 检查条件表达式
-        Expression pred = loop_expr->get_pred();
-        Symbol pred_type = type_check_expression(pred, current_class, object_env, filename);
+        push_list(STEP_FEATURE, indent + 2, c->get_features());
+        return;
+    }
+    for (int i = table->feature_end[item.id]; i > table->feature_begin[item.id]; i--)
+    {
+        push(STEP_FEATURE, indent + 2, table->class_features[i - 1], i - 1);
+    }
+}
+
+void TypedAstWriter::write_feature(const Item& item)
+{
+    Feature f = (Feature)item.node;
+    int indent = item.indent;
+    NodeId expr_id = item.id < 0 ? -1 : table->feature_expr[item.id];
+    put_line_number(indent, f->get_line_number());
+    if (dynamic_cast<method_class*>(f) != NULL)
+    {
+        method_class* method = (method_class*)f;
+        put_text(indent, "_method", 7);
+        put_symbol(indent + 2, method->get_name());
         
-        if (pred_type != Bool)
+        // 参数、返回类型、方法体
+        push(STEP_EXPRESSION, indent + 2, method->get_expr(), expr_id);
+        push(STEP_SYMBOL, indent + 2, NULL, -1, method->get_return_type());
+        push_list(STEP_FORMAL, indent + 2, method->get_formals());
+    }
+    else
+    {
+        attr_class* attr = (attr_class*)f;
+        put_text(indent, "_attr", 5);
+        put_symbol(indent + 2, attr->get_name());
+        put_symbol(indent + 2, attr->get_type());
+        push(STEP_EXPRESSION, indent + 2, attr->get_init(), expr_id);
+    }
+}
+
+// 与ExprKind一一对应的节点名
+static const char* const EXPR_TAGS[EXPR_KIND_COUNT] = {
+    "_assign", "_static_dispatch", "_dispatch", "_cond", "_loop", "_typcase", "_block", "_let",
+    "_plus", "_sub", "_mul", "_divide", "_neg", "_lt", "_eq", "_leq", "_comp",
+    "_int", "_bool", "_string", "_new", "_isvoid", "_no_expr", "_object"
+};
+
+// 输出表达式节点自己的几行，子表达式和之后的行逆序压栈；
+// 每个表达式最后一行是它的类型
+void TypedAstWriter::write_expression(const Item& item)
+{
+    Expression expr = (Expression)item.node;
+    NodeId id = item.id;
+    int indent = item.indent;
+    int inner = indent + 2;
+    ExprKind kind = id < 0 ? expr_kind(expr) : table->expr_index.kind(id);
+    const char* tag = EXPR_TAGS[kind];
+    put_line_number(indent, expr->get_line_number());
+    put_text(indent, tag, strlen(tag));
+    push(STEP_TYPE, indent, expr, id);
+    
+    // 节点名之后、子表达式之前的行
+    switch (kind)
+    {
+    case EXPR_ASSIGN:
+        put_symbol(inner, ((assign_class*)expr)->get_name());
+        break;
+    case EXPR_LET:
+        put_symbol(inner, ((let_class*)expr)->get_identifier());
+        put_symbol(inner, ((let_class*)expr)->get_type_decl());
+        break;
+    case EXPR_INT_CONST:
+        put_symbol(inner, ((int_const_class*)expr)->get_token());
+        break;
+    case EXPR_BOOL_CONST:
+        put_text(inner, ((bool_const_class*)expr)->get_val() ? "1" : "0", 1);
+        break;
+    case EXPR_STRING_CONST:
+        put_string(inner, ((string_const_class*)expr)->get_token()->get_string());
+        break;
+    case EXPR_NEW:
+        put_symbol(inner, ((new__class*)expr)->get_type_name());
+        break;
+    case EXPR_OBJECT:
+        put_symbol(inner, ((object_class*)expr)->get_name());
+        break;
+    default:
+        break;
+    }
+    
+    // 子表达式：有编号时按编号依次跳过子树，否则从AST中取
+    children.clear();
+    if (id >= 0)
+    {
+        const ExprIndex& index = table->expr_index;
+        for (NodeId k = id + 1; k < index.subtree_end(id); k = index.subtree_end(k))
         {
-            semant_error(filename, expr) << "Loop condition does not have type Bool." << endl;
-            semant_errors++;
+            Item child = { STEP_EXPRESSION, inner, index.node(k), k, NULL, NULL };
+            children.push_back(child);
         }
-        
-        // 检查循环体
-        Expression body = loop_expr->get_body();
-        type_check_expression(body, current_class, object_env, filename);
-        
-        // while循环的类型总是Object
-        result_type = Object;
-        loop_expr->set_type(result_type);
     }
-    else if (dynamic_cast<block_class*>(expr) != NULL)
+    else
     {
-        // 块表达式
-        block_class* block_expr = (block_class*)expr;
-        
-        // 块表达式的类型是最后一个表达式的类型
-        Expressions body = block_expr->get_body();
-        
-        // 遍历所有表达式
-        for(int i = body->first(); body->more(i); i = body->next(i))
+        child_exprs.clear();
+        expression_children(expr, child_exprs);
+        for (size_t k = 0; k < child_exprs.size(); k++)
         {
-            Expression e = body->nth(i);
-            result_type = type_check_expression(e, current_class, object_env, filename);
+            Item child = { STEP_EXPRESSION, inner, child_exprs[k], -1, NULL, NULL };
+            children.push_back(child);
         }
-        
-        block_expr->set_type(result_type);
     }
-    else if (dynamic_cast<let_class*>(expr) != NULL)
+    
+    switch (kind)
     {
-        // let表达式
-        let_class* let_expr = (let_class*)expr;
-        
-        // 进入新的作用域
-        object_env->enterscope();
-        
-        // 处理标识符
-        Symbol identifier = let_expr->get_identifier();
-        Symbol type_decl = let_expr->get_type_decl();
-        
-        // 检查类型声明是否存在
-        if (type_decl != SELF_TYPE && class_table->lookup(type_decl) == NULL)
+    case EXPR_STATIC_DISPATCH:
+    case EXPR_DISPATCH:
+        // 接收者、（静态类型、）方法名、括号中的参数
+        push(STEP_TEXT, inner, NULL, -1, NULL, ")");
+        for (size_t k = children.size(); k > 1; k--)
         {
-            semant_error(filename, expr) << "Class " << type_decl << " of let-bound identifier " 
-                << identifier << " is undefined." << endl;
-            semant_errors++;
-            type_decl = Object;
+            pending.push_back(children[k - 1]);
         }
-        
-        // 处理初始化表达式
-        Expression init = let_expr->get_init();
-        if (init->get_type() == NULL)  // 检查是否为空表达式
+        push(STEP_TEXT, inner, NULL, -1, NULL, "(");
+        if (kind == EXPR_STATIC_DISPATCH)
         {
-            // 没有初始化表达式
-            object_env->addid(identifier, new Symbol(type_decl));
+            push(STEP_SYMBOL, inner, NULL, -1, ((static_dispatch_class*)expr)->get_name());
+            push(STEP_SYMBOL, inner, NULL, -1, ((static_dispatch_class*)expr)->get_type_name());
         }
         else
         {
-            // 有初始化表达式，检查类型
-            Symbol init_type = type_check_expression(init, current_class, object_env, filename);
-            
-            if (!is_subtype(init_type, type_decl))
-            {
-                semant_error(filename, expr) << "Inferred type " << init_type 
-                    << " of initialization of " << identifier 
-                    << " does not conform to identifier's declared type " << type_decl << "." << endl;
-                semant_errors++;
-            }
-            
-            object_env->addid(identifier, new Symbol(type_decl));
+            push(STEP_SYMBOL, inner, NULL, -1, ((dispatch_class*)expr)->get_name());
         }
-        
-        // 处理主体表达式
-        Expression body = let_expr->get_body();
-        result_type = type_check_expression(body, current_class, object_env, filename);
-        
-        // 退出作用域
-        object_env->exitscope();
-        
-        let_expr->set_type(result_type);
-    }
-    else if (dynamic_cast<plus_class*>(expr) != NULL)
+        pending.push_back(children[0]);
+        break;
+    case EXPR_TYPCASE:
     {
-        // 加法表达式
-        plus_class* plus_expr = (plus_class*)expr;
-        
-        // 检查左操作数
-        Expression e1 = plus_expr->get_e1();
-        Symbol type1 = type_check_expression(e1, current_class, object_env, filename);
-        
-        // 检查右操作数
-        Expression e2 = plus_expr->get_e2();
-        Symbol type2 = type_check_expression(e2, current_class, object_env, filename);
-        
-        // 两个操作数都必须是Int类型
-        if (type1 != Int || type2 != Int)
+        // 第一个子表达式之后的每个子表达式属于一个分支
+        std::vector<Case> branches;
+        flatten_list(((typcase_class*)expr)->get_cases(), branches);
+        for (size_t k = branches.size(); k > 0; k--)
         {
-            semant_error(filename, expr) << "non-Int arguments: " << type1 << " + " << type2 << endl;
-            semant_errors++;
+            push(STEP_CASE, inner, branches[k - 1], children[k].id);
         }
-        
-        result_type = Int;
-        plus_expr->set_type(result_type);
+        pending.push_back(children[0]);
+        break;
+    }
+    default:
+        for (size_t k = children.size(); k > 0; k--)
+        {
+            pending.push_back(children[k - 1]);
+        }
+        break;
     }
-    else if (dynamic_cast<eq_class*>(expr) != NULL)
+}
+
+void TypedAstWriter::write(Program program, const CheckedProgram* checked)
+{
+    Classes classes = ((program_class*)program)->get_classes();
+    bool indexed = checked != NULL && checked->table != NULL && checked->classes == classes;
+    table = indexed ? checked->table.get() : NULL;
+    types = indexed ? &checked->types : NULL;
+    
+    put_line_number(0, program->get_line_number());
+    put_text(0, "_program", 8);
+    if (indexed)
     {
-        // 相等比较表达式
-        eq_class* eq_expr = (eq_class*)expr;
-        
-        // 检查左操作数
-        Expression e1 = eq_expr->get_e1();
-        Symbol type1 = type_check_expression(e1, current_class, object_env, filename);
-        
-        // 检查右操作数
-        Expression e2 = eq_expr->get_e2();
-        Symbol type2 = type_check_expression(e2, current_class, object_env, filename);
-        
-        // 比较操作可以比较任何类型，但Int、String、Bool只能与相同类型比较
-        if ((type1 == Int || type1 == String || type1 == Bool) && type1 != type2)
+        // 检查通过时程序中的类都已按源程序顺序编号
+        for (ClassId id = table->class_nodes.size(); id > 0; id--)
         {
-            semant_error(filename, expr) << "Illegal comparison with a basic type." << endl;
-            semant_errors++;
+            unsigned char flags = table->class_flags[id - 1];
+            if ((flags & CLASS_DEFINED) && !(flags & (CLASS_BASIC | CLASS_CACHED)))
+            {
+                push(STEP_CLASS, 2, table->class_nodes[id - 1], id - 1);
+            }
         }
-        
-        result_type = Bool;
-        eq_expr->set_type(result_type);
     }
-    else if (dynamic_cast<new__class*>(expr) != NULL)
+    else
+    {
+        push_list(STEP_CLASS, 2, classes);
+    }
+    
+    while (!pending.empty())
     {
-        // new表达式
-        new__class* new_expr = (new__class*)expr;
-        Symbol type_name = new_expr->get_type_name();
+        Item item = pending.back();
+        pending.pop_back();
         
-        // 检查类型是否存在
-        if (type_name != SELF_TYPE && class_table->lookup(type_name) == NULL)
+        switch (item.step)
+        {
+        case STEP_CLASS:
+            write_class(item);
+            break;
+        case STEP_FEATURE:
+            write_feature(item);
+            break;
+        case STEP_FORMAL:
         {
-            semant_error(filename, expr) << "'new' used with undefined class " << type_name << "." << endl;
-            semant_errors++;
-            result_type = Object;
+            formal_class* formal = (formal_class*)item.node;
+            put_line_number(item.indent, formal->get_line_number());
+            put_text(item.indent, "_formal", 7);
+            put_symbol(item.indent + 2, formal->get_name());
+            put_symbol(item.indent + 2, formal->get_type());
+            break;
         }
-        else
+        case STEP_CASE:
         {
-            result_type = type_name;
+            branch_class* branch = (branch_class*)item.node;
+            put_line_number(item.indent, branch->get_line_number());
+            put_text(item.indent, "_branch", 7);
+            put_symbol(item.indent + 2, branch->get_name());
+            put_symbol(item.indent + 2, branch->get_type_decl());
+            push(STEP_EXPRESSION, item.indent + 2, branch->get_expr(), item.id);
+            break;
+        }
+        case STEP_EXPRESSION:
+            write_expression(item);
+            break;
+        case STEP_SYMBOL:
+            put_symbol(item.indent, item.symbol);
+            break;
+        case STEP_TEXT:
+            put_text(item.indent, item.text, strlen(item.text));
+            break;
+        case STEP_TYPE:
+            put_type(item.indent, item.id < 0 ? ((Expression)item.node)->get_type() : types->get(item.id));
+            break;
         }
-        
-        new_expr->set_type(result_type);
-    }
-    else if (dynamic_cast<isvoid_class*>(expr) != NULL)
-    {
-        // isvoid表达式
-        isvoid_class* isvoid_expr = (isvoid_class*)expr;
-        
-        // 检查表达式
-        Expression e1 = isvoid_expr->get_e1();
-        type_check_expression(e1, current_class, object_env, filename);
-        
-        result_type = Bool;
-        isvoid_expr->set_type(result_type);
     }
     
-    // 设置表达式行号（用于输出格式）
-    if (semant_debug) {
-        cerr << "表达式 #" << expr->get_line_number() << " 类型: " << result_type << endl;
+    table = NULL;
+    types = NULL;
+}
+
+size_t TypedAstWriter::size() const
+{
+    size_t total = 0;
+    for (size_t k = 0; k < chunks.size(); k++)
+    {
+        total += chunk_size(k);
     }
-    
-    return result_type;
+    return total;
 }
 
-//////////////////////////////////////////////////////////////////////
-// 类类型检查
-//////////////////////////////////////////////////////////////////////
+void TypedAstWriter::append_to(std::string& out) const
+{
+    out.reserve(out.size() + size());
+    for (size_t k = 0; k < chunks.size(); k++)
+    {
+        out.append(chunks[k].data.get(), chunk_size(k));
+    }
+}
 
-void ClassTable::type_check_class(Class_ c)
+bool TypedAstWriter::flush(int fd)
 {
-    if (c == NULL) return;
-    
-    Symbol class_name = c->get_name();
-    Symbol parent = c->get_parent();
-    Features features = c->get_features();
-    const char* filename = c->get_filename()->get_string();
-    
-    if (semant_debug) {
-        cerr << "类型检查类: " << class_name << endl;
+    std::vector<struct iovec> buffers;
+    for (size_t k = 0; k < chunks.size(); k++)
+    {
+        if (chunk_size(k) == 0) continue;
+        struct iovec buffer;
+        buffer.iov_base = chunks[k].data.get();
+        buffer.iov_len = chunk_size(k);
+        buffers.push_back(buffer);
     }
     
-    // 创建对象环境（用于变量类型）
-    SymbolTable<Symbol, Symbol>* object_env = new SymbolTable<Symbol, Symbol>();
-    object_env->enterscope();
-    
-    // 添加self变量（类型为SELF_TYPE）
-    object_env->addid(self, new Symbol(SELF_TYPE));
-    
-    // 遍历所有特性
-    for(int i = features->first(); features->more(i); i = features->next(i))
+    // 每次最多IOV_MAX块；只写出一部分时从断开的位置继续
+    size_t next = 0;
+    while (next < buffers.size())
     {
-        Feature f = features->nth(i);
-        
-        if (dynamic_cast<attr_class*>(f) != NULL)
+        int count = std::min(buffers.size() - next, (size_t)IOV_MAX);
+        ssize_t written = writev(fd, &buffers[next], count);
+        if (written < 0)
         {
-            // 属性检查
-            attr_class* attr = (attr_class*)f;
-            Symbol attr_name = attr->get_name();
-            Symbol attr_type = attr->get_type();
-            
-            if (semant_debug) {
-                cerr << "检查属性: " << attr_name << " : " << attr_type << endl;
-            }
-            
-            // 检查属性类型是否存在
-            if (attr_type != SELF_TYPE && class_table->lookup(attr_type) == NULL)
-            {
-                semant_error(c) << "Class " << attr_type << " of attribute " << attr_name << " is undefined." << endl;
-                semant_errors++;
-                attr_type = Object;
-            }
-            
-            // 检查初始化表达式
-            Expression init = attr->get_init();
-            if (init->get_type() != NULL)  // 如果有初始化表达式
-            {
-                Symbol init_type = type_check_expression(init, class_name, object_env, filename);
-                
-                if (!is_subtype(init_type, attr_type))
-                {
-                    semant_error(c) << "Inferred type " << init_type 
-                        << " of initialization of attribute " << attr_name 
-                        << " does not conform to declared type " << attr_type << "." << endl;
-                    semant_errors++;
-                }
-            }
-            
-            // 添加属性到对象环境
-            object_env->addid(attr_name, new Symbol(attr_type));
+            if (errno == EINTR) continue;
+            return false;
         }
-        else if (dynamic_cast<method_class*>(f) != NULL)
+        while (next < buffers.size() && (size_t)written >= buffers[next].iov_len)
         {
-            // 方法检查
-            method_class* method = (method_class*)f;
-            Symbol method_name = method->get_name();
-            Symbol return_type = method->get_return_type();
-            Formals formals = method->get_formals();
-            Expression expr = method->get_expr();
-            
-            if (semant_debug) {
-                cerr << "检查方法: " << method_name << " : " << return_type << endl;
-            }
-            
-            // 检查返回类型
-            if (return_type != SELF_TYPE && class_table->lookup(return_type) == NULL)
-            {
-                semant_error(c) << "Undefined return type " << return_type 
-                    << " in method " << method_name << "." << endl;
-                semant_errors++;
-                return_type = Object;
-            }
-            
-            // 进入新的作用域
-            object_env->enterscope();
-            
-            // 添加参数到环境
-            for(int j = formals->first(); formals->more(j); j = formals->next(j))
-            {
-                Formal formal = formals->nth(j);
-                Symbol formal_name = formal->get_name();
-                Symbol formal_type = formal->get_type();
-                
-                // 检查参数类型
-                if (formal_type != SELF_TYPE && class_table->lookup(formal_type) == NULL)
-                {
-                    semant_error(c) << "Class " << formal_type << " of formal parameter " 
-                        << formal_name << " is undefined." << endl;
-                    semant_errors++;
-                    formal_type = Object;
-                }
-                
-                // 检查参数名是否重复
-                Symbol *existing_type = object_env->probe(formal_name);
-                if (existing_type != NULL)
-                {
-                    semant_error(c) << "Formal parameter " << formal_name << " is multiply defined." << endl;
-                    semant_errors++;
-                }
-                else
-                {
-                    object_env->addid(formal_name, new Symbol(formal_type));
-                }
-            }
-            
-            // 检查方法体
-            Symbol expr_type = type_check_expression(expr, class_name, object_env, filename);
-            
-            // 检查返回类型
-            if (return_type == SELF_TYPE)
-            {
-                if (expr_type != SELF_TYPE)
-                {
-                    semant_error(c) << "Inferred return type " << expr_type 
-                        << " of method " << method_name 
-                        << " does not conform to declared return type SELF_TYPE." << endl;
-                    semant_errors++;
-                }
-            }
-            else if (!is_subtype(expr_type, return_type))
-            {
-                semant_error(c) << "Inferred return type " << expr_type 
-                    << " of method " << method_name 
-                    << " does not conform to declared return type " << return_type << "." << endl;
-                semant_errors++;
-            }
-            
-            // 退出作用域
-            object_env->exitscope();
-            
-            // 检查方法重写
-            if (parent != No_class)
-            {
-                method_class* parent_method = find_method(parent, method_name);
-                if (parent_method != NULL)
-                {
-                    // 检查参数数量
-                    Formals parent_formals = parent_method->get_formals();
-                    int parent_param_count = 0;
-                    int child_param_count = 0;
-                    
-                    for(int j = parent_formals->first(); parent_formals->more(j); j = parent_formals->next(j))
-                        parent_param_count++;
-                    
-                    for(int j = formals->first(); formals->more(j); j = formals->next(j))
-                        child_param_count++;
-                    
-                    if (parent_param_count != child_param_count)
-                    {
-                        semant_error(c) << "In redefined method " << method_name 
-                            << ", parameter number differs from original." << endl;
-                        semant_errors++;
-                    }
-                    else
-                    {
-                        // 检查参数类型
-                        for(int j = formals->first(), k = parent_formals->first(); 
-                            formals->more(j) && parent_formals->more(k); 
-                            j = formals->next(j), k = parent_formals->next(k))
-                        {
-                            Formal child_formal = formals->nth(j);
-                            Formal parent_formal = parent_formals->nth(k);
-                            
-                            Symbol child_formal_type = child_formal->get_type();
-                            Symbol parent_formal_type = parent_formal->get_type();
-                            
-                            if (child_formal_type != parent_formal_type)
-                            {
-                                semant_error(c) << "In redefined method " << method_name 
-                                    << ", parameter type " << child_formal_type 
-                                    << " differs from original type " << parent_formal_type << "." << endl;
-                                semant_errors++;
-                            }
-                        }
-                    }
-                    
-                    // 检查返回类型
-                    Symbol parent_return_type = parent_method->get_return_type();
-                    if (return_type != parent_return_type)
-                    {
-                        semant_error(c) << "In redefined method " << method_name 
-                            << ", return type " << return_type 
-                            << " differs from original return type " << parent_return_type << "." << endl;
-                        semant_errors++;
-                    }
-                }
-            }
+            written -= buffers[next].iov_len;
+            next++;
+        }
+        if (written > 0)
+        {
+            buffers[next].iov_base = (char*)buffers[next].iov_base + written;
+            buffers[next].iov_len -= written;
         }
     }
     
-    // 退出对象环境
-    object_env->exitscope();
-    delete object_env;
+    chunks.clear();
+    cursor = limit = NULL;
+    return true;
 }
 
-//////////////////////////////////////////////////////////////////////
-// 整体类型检查
-//////////////////////////////////////////////////////////////////////
+// program_class::semant检查通过的结果，只保留到下一次dump_typed_ast
+static CheckedProgram last_checked;
 
-void ClassTable::type_check()
+bool dump_typed_ast(Program program, int fd)
 {
-    if (semant_debug) {
-        cerr << "开始类型检查" << endl;
-    }
+    TypedAstWriter writer;
+    writer.write(program, &last_checked);
     
-    // 遍历所有类进行类型检查
-    for (ClassTable::iterator it = begin(); it != end(); ++it)
-    {
-        Symbol class_name = it->first;
-        Class_ *class_ptr = it->second;
-        
-        if (class_ptr != NULL)
-        {
-            Class_ c = *class_ptr;
-            type_check_class(c);
-        }
-    }
+    // 输出已经全部在缓冲区中，释放类表快照和类型表
+    last_checked = CheckedProgram();
+    return writer.flush(fd);
 }
 
 //////////////////////////////////////////////////////////////////////
-// 输出格式：类型标注的AST
+// 语义分析器入口
 //////////////////////////////////////////////////////////////////////
 
 // 语义分析器入口函数
-void program_class::semant()
+int semant_check(Classes classes, ostream& errors, int jobs, SemantStats* stats, CheckedProgram* checked)
 {
-    initialize_constants();
+    // 调用者要求或打开--stats时记录本程序各阶段的耗时和计数
+    SemantStats own_stats;
+    SemantStats* run_stats = stats != NULL ? stats : semant_stats_file != NULL ? &own_stats : NULL;
     
-    if (semant_debug) {
-        cerr << "=== 开始语义分析 ===" << endl;
+    // 创建类表并进行语义分析
+    ClassTable *classtable = new ClassTable(classes, run_stats);
+    
+    // 继承关系有错误时不再进行类型检查
+    if (classtable->errors() == 0) {
+        {
+            PhaseTimer timer(run_stats, "freeze");
+            classtable->freeze();
+        }
+        PhaseTimer timer(run_stats, "type_check");
+        classtable->type_check(jobs, run_stats != NULL ? &run_stats->counters : NULL);
     }
     
-    // 创建类表并进行语义分析
-    ClassTable *classtable = new ClassTable(classes);
+    // 检查通过，按需把本程序的类写入类摘要缓存
+    if (classtable->errors() == 0 && semant_write_class_cache != NULL &&
+        !classtable->freeze()->write_class_cache(semant_write_class_cache)) {
+        cerr << "semant: cannot write class cache " << semant_write_class_cache << endl;
+    }
     
-    // 如果有错误，直接返回
-    if (classtable->errors()) {
-        cerr << "Compilation halted due to static semantic errors." << endl;
-        exit(1);
+    // 所有诊断信息排序、去重后一次写出
+    int error_count;
+    {
+        PhaseTimer timer(run_stats, "write_diagnostics");
+        error_count = classtable->write_diagnostics(errors, semant_diagnostics_json);
+    }
+    if (classtable->stopped() && !semant_diagnostics_json) {
+        errors << "Too many errors, analysis stopped after " << error_count << " errors (--max-errors "
+               << semant_max_errors << ")." << endl;
+    }
+    
+    // 检查通过，保留快照和推断的类型供输出带类型的AST
+    if (checked != NULL && classtable->errors() == 0) {
+        checked->classes = classes;
+        checked->table = classtable->freeze();
+        checked->types = classtable->inferred_types();
+    }
+    delete classtable;
+    
+    if (run_stats != NULL) {
+        run_stats->programs++;
+        run_stats->errors += error_count;
+        if (run_stats == &own_stats) record_stats(own_stats);
     }
+    return error_count;
+}
+
+void semant_batch(const std::vector<Classes>& programs, std::vector<ProgramVerdict>& verdicts)
+{
+    verdicts.assign(programs.size(), ProgramVerdict());
     
-    // 进行类型检查
-    classtable->type_check();
+    // 每个程序一个任务，程序内部串行检查，避免线程数相乘
+    TaskPool pool(semant_jobs > 1 ? semant_jobs : 1);
+    for (size_t k = 0; k < programs.size(); k++)
+    {
+        pool.push(k % pool.workers(), [&programs, &verdicts, k](int) {
+            std::ostringstream errors;
+            verdicts[k].errors = semant_check(programs[k], errors, 1);
+            verdicts[k].diagnostics = errors.str();
+        });
+    }
+    pool.run();
+}
+
+void program_class::semant()
+{
+    if (semant_debug) {
+        cerr << "=== 开始语义分析 ===" << endl;
+    }
     
-    // 如果还有错误，退出
-    if (classtable->errors()) {
-        cerr << "Compilation halted due to static semantic errors." << endl;
+    // 如果有错误，退出
+    if (semant_check(classes, cerr, semant_jobs, NULL, &last_checked)) {
+        if (!semant_diagnostics_json) {
+            cerr << "Compilation halted due to static semantic errors." << endl;
+        }
         exit(1);
     }
     
@@ -6,28 +6,552 @@
 #define SEMANT_H_
 
 #include <iostream>
+#include <sstream>
 #include <set>
 #include <vector>
 #include <string>
+#include <unordered_map>
+#include <typeindex>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <stdint.h>
 #include "cool-tree.h"
-#include "symtab.h"
 
-// 错误报告函数声明
-void semant_error();
-void semant_error(Class_ c);
-void semant_error(Symbol filename, tree_node *t);
+// 类型检查使用的线程数（-j N），1表示串行
+extern int semant_jobs;
+
+// 增量检查（--incremental）：保留上一次检查的类摘要，在同一进程中
+// 再次检查时，内容和所依赖的类都没有变化的类直接复用上次的结果
+extern bool semant_incremental;
+
+// 类摘要缓存文件：--class-cache FILE 载入事先检查过的库类，
+// --write-class-cache FILE 在检查通过后把本程序的类写入缓存；NULL表示不使用
+extern const char *semant_class_cache;
+extern const char *semant_write_class_cache;
+
+// 诊断信息以JSON数组输出（--diagnostics-json），默认为"文件名:行号: 消息"的文本
+extern bool semant_diagnostics_json;
+
+// 错误数上限（--max-errors N）：达到N个错误后停止检查，0表示不限
+extern int semant_max_errors;
+
+// 处理语义分析器自己的命令行选项（-j N、--incremental、--class-cache FILE、
+// --write-class-cache FILE、--diagnostics-json、--max-errors N、--trace FILE、
+// --stats FILE），并把它们从argv中移除；
+// 应在handle_flags之前调用
+void handle_semant_flags(int *argc, char *argv[]);
+
+struct SemantStats;
+struct CheckedProgram;
+
+// 对一个程序进行语义分析，用jobs个线程检查各个类，错误输出写入errors，
+// 返回错误数；与program_class::semant不同，有错误时不退出进程，可以反复调用。
+// stats不为NULL时把本程序各阶段的耗时和计数累加到stats；checked不为NULL
+// 且检查通过时保留类表和推断的类型，供TypedAstWriter快速输出
+int semant_check(Classes classes, ostream& errors, int jobs, SemantStats* stats = NULL,
+                 CheckedProgram* checked = NULL);
+
+// 批量检查中一个程序的结果
+struct ProgramVerdict {
+    int errors;                            // 错误数，0表示通过
+    std::string diagnostics;               // 错误输出
+};
+
+// 批量检查多个互不相关的程序：每个程序有自己的类表，用semant_jobs个线程
+// 同时检查不同的程序；verdicts与programs一一对应
+void semant_batch(const std::vector<Classes>& programs, std::vector<ProgramVerdict>& verdicts);
 
 //////////////////////////////////////////////////////////////////////
-// ClassTable类 - 语义分析器的核心数据结构
+// 诊断信息
+//
+// 检查过程中的错误先作为结构化记录（文件、行号、错误码、参数）收集在
+// 内存中，全部检查完成后一次性排序、去重、格式化输出。并行检查时
+// 每个特性有自己的Diagnostics，最后用append按顺序合并。
 //////////////////////////////////////////////////////////////////////
 
-class ClassTable {
+// 错误码，与semant.cc中的消息模板表一一对应
+enum DiagCode {
+    DIAG_CLASS_REDEFINED,
+    DIAG_CLASS_NAMED_SELF_TYPE,
+    DIAG_INHERIT_BASIC,
+    DIAG_INHERIT_UNDEFINED,
+    DIAG_INHERIT_CYCLE,
+    DIAG_UNDECLARED_IDENTIFIER,
+    DIAG_ASSIGN_UNDECLARED,
+    DIAG_ASSIGN_TYPE,
+    DIAG_UNDEFINED_METHOD,
+    DIAG_WRONG_ARGUMENT_COUNT,
+    DIAG_ARGUMENT_TYPE,
+    DIAG_STATIC_DISPATCH_TYPE,
+    DIAG_IF_PREDICATE,
+    DIAG_LOOP_CONDITION,
+    DIAG_LET_UNDEFINED_TYPE,
+    DIAG_LET_INIT_TYPE,
+    DIAG_ARITH_NON_INT,
+    DIAG_BASIC_COMPARISON,
+    DIAG_NEW_UNDEFINED,
+    DIAG_ATTR_UNDEFINED_TYPE,
+    DIAG_ATTR_INIT_TYPE,
+    DIAG_RETURN_UNDEFINED,
+    DIAG_FORMAL_UNDEFINED_TYPE,
+    DIAG_FORMAL_REDEFINED,
+    DIAG_RETURN_TYPE,
+    DIAG_OVERRIDE_ARITY,
+    DIAG_OVERRIDE_FORMAL,
+    DIAG_OVERRIDE_RETURN,
+    DIAG_CODE_COUNT
+};
+
+// 消息参数：符号或整数（参数序号）
+struct DiagArg {
+    Symbol symbol;                         // 非NULL时为符号参数
+    int number;
+    DiagArg() : symbol(NULL), number(0) {}
+    DiagArg(Symbol s) : symbol(s), number(0) {}
+    DiagArg(int n) : symbol(NULL), number(n) {}
+};
+
+// 一条诊断记录
+struct Diagnostic {
+    const char* filename;
+    tree_node* node;                       // 报告错误的节点，去重时只合并同一节点的记录
+    int line;
+    DiagCode code;
+    DiagArg args[4];                       // 对应消息模板中的%0..%3
+};
+
+class Diagnostics {
 private:
-    int semant_errors;                     // 错误计数器
-    ostream& error_stream;                 // 错误输出流
+    std::vector<Diagnostic> records;       // 按报告顺序
+    bool limited;                          // 是否因为--max-errors丢弃过记录
+    
+public:
+    Diagnostics() : limited(false) {}
+    
+    void report(const char* filename, tree_node* node, DiagCode code,
+                DiagArg a0 = DiagArg(), DiagArg a1 = DiagArg(),
+                DiagArg a2 = DiagArg(), DiagArg a3 = DiagArg());
+    
+    // 把other的记录追加到末尾（并行检查结果的合并点）
+    void append(const Diagnostics& other) {
+        records.insert(records.end(), other.records.begin(), other.records.end());
+    }
+    void swap(Diagnostics& other) { records.swap(other.records); std::swap(limited, other.limited); }
+    void clear() { records.clear(); limited = false; }
+    void truncate(int n) { if ((int)records.size() > n) { records.resize(n); limited = true; } } // 只保留前n条
+    int count() const { return records.size(); }
+    
+    // 错误数达到上限后又有错误被丢弃，分析没有完成
+    void mark_stopped() { limited = true; }
+    bool stopped() const { return limited; }
+    
+    // 按文件（首次出现的顺序）和行号稳定排序、去掉同一节点重复报告的记录后，
+    // 一次写入out，返回写出的条数；json为true时输出JSON数组
+    int write(ostream& out, bool json) const;
+};
+
+//////////////////////////////////////////////////////////////////////
+// 跟踪
+//
+// 跟踪是编译时选项：用-DSEMANT_TRACE编译时，热路径上的事件写入每个
+// 线程自己的二进制环形缓冲区（只保留最近的事件），--trace FILE在进程
+// 退出时把它们写入FILE，可以用semant-trace转成文本；不定义SEMANT_TRACE时
+// SEMANT_TRACE_EVENT展开为空，发布版本中不留下任何分支和代码。
+//////////////////////////////////////////////////////////////////////
+
+// 事件种类；value和两个符号参数的含义见各项注释
+enum TraceKind {
+    TRACE_EXPR_BEGIN,                      // value=行号
+    TRACE_EXPR_END,                        // value=行号，a=推断的类型
+    TRACE_DISPATCH,                        // value=行号，a=接收者类型，b=方法名
+    TRACE_IS_SUBTYPE,                      // a=子类型，b=父类型
+    TRACE_LUB,                             // a、b=两个类型
+    TRACE_FIND_METHOD,                     // value=是否找到，a=类名，b=方法名
+    TRACE_FIND_SIGNATURE,                  // a=类名，b=方法名
+    TRACE_KIND_COUNT
+};
+
+#ifdef SEMANT_TRACE
+void semant_trace(TraceKind kind, int value, Symbol a, Symbol b);
+#define SEMANT_TRACE_EVENT(kind, value, a, b) semant_trace(kind, value, a, b)
+#else
+#define SEMANT_TRACE_EVENT(kind, value, a, b) ((void)0)
+#endif
+
+// 跟踪文件（--trace FILE），NULL表示不写；没有定义SEMANT_TRACE时忽略
+extern const char *semant_trace_file;
+
+// 跟踪文件格式：头部，events_count个事件，然后是以'\0'结尾的字符串区；
+// 事件中的符号是字符串区中的偏移，TRACE_NO_SYMBOL表示没有
+#define TRACE_FILE_MAGIC "SEMTRACE"
+const uint32_t TRACE_FILE_VERSION = 1;
+const uint32_t TRACE_NO_SYMBOL = (uint32_t)-1;
+
+struct TraceFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t thread_count;
+    uint64_t event_count;
+    uint64_t string_size;                  // 字符串区的字节数
+};
+
+struct TraceFileEvent {
+    uint64_t time;                         // 距进程开始跟踪的纳秒数
+    uint32_t thread;                       // 线程编号，按第一次记录事件的顺序
+    uint32_t kind;                         // TraceKind
+    int32_t value;
+    uint32_t a;
+    uint32_t b;
+    uint32_t reserved;
+};
+
+//////////////////////////////////////////////////////////////////////
+// 运行统计
+//
+// --stats FILE 打开统计：记录每个阶段的耗时和堆增长，以及类型检查中
+// 子类型、LUB和方法查找的次数等，进程退出时把所有程序的合计以JSON
+// 写入FILE。不打开时不读时钟，也不计算父类链的长度。
+//////////////////////////////////////////////////////////////////////
+
+extern const char *semant_stats_file;
+
+// 类型检查中的计数，每个检查器各自累加，检查结束后合并
+struct CheckerCounters {
+    uint64_t classes_checked;
+    uint64_t expressions_checked;
+    uint64_t subtype_checks;
+    uint64_t lub_calls;
+    uint64_t method_lookups;
+    uint64_t chain_walk_steps;             // 沿父类链查找时需要的步数之和
+    int peak_scope_depth;                  // 对象环境最多同时打开的作用域数
+    
+    CheckerCounters() : classes_checked(0), expressions_checked(0), subtype_checks(0),
+                        lub_calls(0), method_lookups(0), chain_walk_steps(0), peak_scope_depth(0) {}
+    void merge(const CheckerCounters& other);
+};
+
+// 一个阶段的耗时和堆增长（多个程序的同名阶段累加）
+struct PhaseStats {
+    const char* name;
+    double seconds;
+    long long heap_bytes;
+};
+
+struct SemantStats {
+    int programs;
+    int errors;
+    std::vector<PhaseStats> phases;        // 按第一次出现的顺序
+    CheckerCounters counters;
+    
+    SemantStats() : programs(0), errors(0) {}
+    void add_phase(const char* name, double seconds, long long heap_bytes);
+    void merge(const SemantStats& other);
+};
+
+//////////////////////////////////////////////////////////////////////
+// 类编号与类的元数据
+//////////////////////////////////////////////////////////////////////
+
+// 每个类在构建继承图后被分配一个稠密编号，所有类查询都基于编号进行
+typedef uint32_t ClassId;
+const ClassId NO_CLASS_ID = (ClassId)-1;
+
+// 类的标志位
+enum ClassFlag {
+    CLASS_BASIC           = 1,             // 基本类：Object/IO/Int/Bool/String
+    CLASS_NON_INHERITABLE = 2,             // 不能被继承：Int/Bool/String
+    CLASS_DEFINED         = 4,             // 有定义（未置位表示只被引用为父类）
+    CLASS_CACHED          = 8              // 从类摘要缓存载入，已经检查过
+};
+
+//////////////////////////////////////////////////////////////////////
+// 表达式节点种类
+//////////////////////////////////////////////////////////////////////
+
+// 每种AST表达式节点对应一个种类，类型检查用switch按种类分派，
+// 不再对每个节点依次尝试dynamic_cast
+enum ExprKind {
+    EXPR_ASSIGN,
+    EXPR_STATIC_DISPATCH,
+    EXPR_DISPATCH,
+    EXPR_COND,
+    EXPR_LOOP,
+    EXPR_TYPCASE,
+    EXPR_BLOCK,
+    EXPR_LET,
+    EXPR_PLUS,
+    EXPR_SUB,
+    EXPR_MUL,
+    EXPR_DIVIDE,
+    EXPR_NEG,
+    EXPR_LT,
+    EXPR_EQ,
+    EXPR_LEQ,
+    EXPR_COMP,
+    EXPR_INT_CONST,
+    EXPR_BOOL_CONST,
+    EXPR_STRING_CONST,
+    EXPR_NEW,
+    EXPR_ISVOID,
+    EXPR_NO_EXPR,
+    EXPR_OBJECT,
+    EXPR_KIND_COUNT
+};
+
+// 取得表达式节点的种类（按动态类型查表）
+ExprKind expr_kind(Expression expr);
+
+//////////////////////////////////////////////////////////////////////
+// 列表的扁平化和表达式编号
+//
+// list_node只能按下标取元素：append构成的列表上每次nth都要从根走到
+// 叶子，more每次还要重新计算整个列表的长度，用first/more/next/nth
+// 遍历是列表长度的平方。每个列表在建表时只用flatten_list遍历一次，
+// 之后的检查都在连续的数组上进行。
+//
+// 建表时所有表达式按先序编上连续的号（NodeId），一个表达式的子树
+// 占据从它自己开始的一段连续编号，第一个子表达式紧跟在它后面，
+// 下一个兄弟跳过前一个兄弟的整棵子树。推断出的类型按编号存放在
+// ExprTypes中，检查结束后再统一写回AST。
+//////////////////////////////////////////////////////////////////////
+
+// 把list的元素依次追加到out：沿append树走一遍，与列表长度成正比。
+// 定义在semant.cc中，对Class_、Feature、Formal、Expression和Case显式实例化
+template <class Elem>
+void flatten_list(list_node<Elem>* list, std::vector<Elem>& out);
+
+// 表达式编号，按先序从0开始
+typedef int NodeId;
+
+// 所有表达式的先序编号：节点、种类和子树大小按编号连续存放。
+// 建好后只读，可以被多个检查线程同时查询
+class ExprIndex {
+private:
+    std::vector<Expression> nodes;         // 编号 -> 表达式
+    std::vector<unsigned char> kinds;      // 编号 -> ExprKind
+    std::vector<int> sizes;                // 编号 -> 子树的节点数（包括自己）
+    
+public:
+    NodeId add(Expression root);           // 为root的整棵子树编号，返回root的编号
+    int size() const { return nodes.size(); }
+    Expression node(NodeId id) const { return nodes[id]; }
+    ExprKind kind(NodeId id) const { return (ExprKind)kinds[id]; }
+    NodeId subtree_end(NodeId id) const { return id + sizes[id]; } // 子树之后的第一个编号
+};
+
+// 按编号存放的推断类型。检查开始前从AST取出现有的类型，检查时各线程
+// 只写自己检查的表达式的槽位，互不重叠，不需要加锁；全部完成后写回AST
+class ExprTypes {
+private:
+    std::vector<Symbol> types;
+    
+public:
+    void load(const ExprIndex& index);     // 取出AST上现有的类型
+    void publish(const ExprIndex& index) const; // 把类型写回AST，之后get_type的结果与直接标注时相同
+    int size() const { return types.size(); }
+    Symbol get(NodeId id) const { return types[id]; }
+    void set(NodeId id, Symbol type) { types[id] = type; }
+};
+
+// 按先序收集expr及其所有子表达式
+void collect_expressions(Expression expr, std::vector<Expression>& nodes);
+
+// 方法签名：登记类时为每个方法计算一次
+struct MethodSignature {
+    int arity;                             // 参数个数
+    int formals_begin;                     // 参数类型在signature_formals中的起始下标
+    Symbol return_type;                    // 声明的返回类型
+};
+
+// 方法表项：方法定义及其签名
+struct MethodEntry {
+    method_class* method;
+    int signature;                         // signatures中的下标
+};
+
+// 方法表：方法名 -> 方法表项（包含继承来的方法）
+typedef std::unordered_map<Symbol, MethodEntry> MethodTable;
+
+//////////////////////////////////////////////////////////////////////
+// ObjectEnv - 对象环境（变量名 -> 类型）的作用域栈
+//
+// 所有绑定连续存放在一个数组中，每个作用域只记录开始位置；
+// 一个开放寻址的小哈希表记录每个名字最内层绑定的下标，
+// 被遮蔽的绑定通过shadowed串起来，退出作用域时恢复。
+// 数组和哈希表在类之间复用，绑定本身不再单独分配内存。
+// 可以指定一个只读的外层环境，本环境中找不到的名字到外层查找，
+// 这样同一个类的属性环境可以被多个方法的检查共享。
+//////////////////////////////////////////////////////////////////////
+
+class ObjectEnv {
+private:
+    struct Binding {
+        Symbol name;
+        Symbol type;
+        int shadowed;                      // 被遮蔽的同名绑定下标，-1表示没有
+    };
+    
+    std::vector<Binding> bindings;         // 所有作用域的绑定
+    std::vector<int> scope_marks;          // 每个作用域开始时bindings的大小
+    
+    // 名字 -> 最内层绑定下标（-1表示当前没有绑定），线性探测
+    std::vector<Symbol> index_keys;
+    std::vector<int> index_values;
+    int index_used;
+    
+    const ObjectEnv* outer;                // 外层环境，NULL表示没有
+    int peak_scopes;                       // 最多同时打开的作用域数
+    
+    int slot(Symbol name) const;           // 名字在哈希表中的槽位
+    void grow_index();                     // 哈希表扩容
+    
+public:
+    ObjectEnv();
+    
+    void enterscope() {
+        scope_marks.push_back(bindings.size());
+        if ((int)scope_marks.size() > peak_scopes) peak_scopes = scope_marks.size();
+    }
+    void exitscope();
+    void addid(Symbol name, Symbol type);
+    Symbol lookup(Symbol name) const;      // 查找类型，未声明返回NULL
+    Symbol probe(Symbol name) const;       // 只在当前作用域中查找
+    void clear();                          // 清空所有作用域，保留已分配的内存
+    void set_outer(const ObjectEnv* env) { outer = env; }
+    int peak_depth() const { return peak_scopes; }
+};
+
+//////////////////////////////////////////////////////////////////////
+// FrozenClassTable - 冻结的类表
+//
+// 继承层次、方法表和属性布局的只读快照，由ClassTable::freeze()产生。
+// 快照创建后不再被修改，所有查询都是const的，任意多个检查线程
+// 可以不加锁地同时查询；同一个快照可以在进程中被多次用于检查。
+//////////////////////////////////////////////////////////////////////
+
+class FrozenClassTable {
+    friend class ClassChecker;
+    friend class TypedAstWriter;
+    
+protected:
+    // 类名 -> 类编号
+    std::unordered_map<Symbol, ClassId> class_ids;
+    
+    // 按编号存放的类元数据（结构数组）
+    std::vector<Class_> class_nodes;       // 类的AST节点，只被引用的类为NULL
+    std::vector<Symbol> class_names;       // 类名
+    std::vector<ClassId> class_parent;     // 父类编号，Object为NO_CLASS_ID
+    std::vector<int> class_depth;          // 继承深度，Object为0
+    std::vector<unsigned char> class_flags; // ClassFlag的组合
+    std::vector<int> feature_begin;        // 类的特性在class_features中的区间
+    std::vector<int> feature_end;
+    std::vector<Feature> class_features;   // 所有类的特性，按类连续存放
+    std::vector<int> feature_signature;    // 与class_features对应：方法的签名下标，属性为-1
+    std::vector<NodeId> feature_expr;      // 与class_features对应：属性初始化或方法体的编号，末尾多一个哨兵
+    ExprIndex expr_index;                  // 程序中特性的表达式的先序编号，不含基本类和缓存中的类
+    
+    // 方法签名，参数类型连续存放
+    std::vector<MethodSignature> signatures;
+    std::vector<Symbol> signature_formals;
+    
+    // 继承树的先序/后序区间编号，未编号为-1
+    // A <= B 当且仅当 B 的区间包含 A 的区间
+    std::vector<int> class_pre;
+    std::vector<int> class_post;
+    std::vector<int> class_euler;          // 在欧拉序列中第一次出现的下标
     
-    // 类表：存储所有类的符号表
-    SymbolTable<Symbol, Class_> *class_table;
+    // LCA结构：欧拉序列 + 稀疏表RMQ，lub查询为O(1)
+    std::vector<ClassId> euler_tour;       // 欧拉序列中的类
+    std::vector<int> euler_depth;          // 对应的继承深度
+    std::vector<int> euler_log;            // euler_log[n] = floor(log2(n))
+    std::vector<std::vector<int> > lca_table; // lca_table[k][i]: [i, i+2^k)中深度最小的下标
+    
+    // 每个类的扁平方法表；没有定义新方法的类直接共用父类的表
+    std::vector<MethodTable> method_tables;
+    std::vector<int> class_method_table;   // 类编号 -> method_tables下标，-1表示没有
+    
+    // 属性布局：每个类的全部属性（先祖先类的，后本类的），按类连续存放
+    std::vector<int> layout_begin;         // 类的布局在layout_attrs中的区间
+    std::vector<int> layout_end;
+    std::vector<attr_class*> layout_attrs;
+    
+    FrozenClassTable() {}
+    
+public:
+    // 查询（基于类编号）
+    ClassId class_id(Symbol name) const;   // 查找类编号，没有则返回NO_CLASS_ID
+    bool is_defined(Symbol name) const;    // 是否为有定义的类
+    bool is_subtype(ClassId child, ClassId parent) const;
+    ClassId lub(ClassId type1, ClassId type2) const;
+    method_class* find_method(ClassId class_id, Symbol method_name) const;
+    const MethodEntry* find_entry(ClassId class_id, Symbol method_name) const;
+    const MethodSignature* find_signature(ClassId class_id, Symbol method_name) const;
+    Symbol signature_formal(const MethodSignature* signature, int k) const {
+        return signature_formals[signature->formals_begin + k];
+    }
+    
+    // 查询（基于类名，处理SELF_TYPE等特殊类型后转为编号查询）
+    bool is_subtype(Symbol child, Symbol parent) const;  // 检查子类型关系
+    Symbol lub(Symbol type1, Symbol type2) const;        // 计算最小上界
+    Symbol lub(const std::vector<Symbol>& types) const;  // 多个类型的最小上界
+    method_class* find_method(Symbol class_name, Symbol method_name) const; // 查找方法
+    const MethodSignature* find_signature(Symbol class_name, Symbol method_name) const; // 查找方法签名
+    
+    // 属性布局：类id的第k个属性（0 <= k < attribute_count(id)）
+    int attribute_count(ClassId id) const { return layout_end[id] - layout_begin[id]; }
+    attr_class* attribute(ClassId id, int k) const { return layout_attrs[layout_begin[id] + k]; }
+    
+    // 用jobs个线程检查所有有定义的类，诊断信息追加到diagnostics，推断的类型
+    // 放在types中并在最后写回AST，返回错误数；counters不为NULL时累加各检查器
+    // 的计数；可以重复调用
+    int type_check(Diagnostics& diagnostics, int jobs, ExprTypes& types,
+                   CheckerCounters* counters = NULL) const;
+    
+    // 统计用：按父类链从child找到parent需要的步数，不是子类型时为child的深度
+    int chain_walk_length(Symbol child, Symbol parent) const;
+    
+    // 把除基本类以外的所有类的摘要写入类摘要缓存文件，失败返回false
+    bool write_class_cache(const char* path) const;
+    
+    // 表达式编号
+    const ExprIndex& expressions() const { return expr_index; }
+    NodeId expressions_begin(ClassId id) const { return feature_expr[feature_begin[id]]; } // 类的表达式的编号区间
+    NodeId expressions_end(ClassId id) const { return feature_expr[feature_end[id]]; }
+    
+    // 增量检查用的指纹
+    uint64_t class_fingerprint(ClassId id) const;                // 类的全部内容
+    void interface_fingerprints(std::vector<uint64_t>& hashes) const; // 每个类对其他类可见的部分
+    
+    // 迭代器支持：按编号顺序遍历类，只被引用的类为NULL
+    typedef std::vector<Class_>::const_iterator iterator;
+    iterator begin() const { return class_nodes.begin(); }
+    iterator end() const { return class_nodes.end(); }
+    
+    // 类查找
+    Class_ get_class(ClassId id) const {
+        return class_flags[id] & CLASS_DEFINED ? class_nodes[id] : NULL;
+    }
+    Class_ get_class(Symbol name) const {
+        ClassId id = class_id(name);
+        return id == NO_CLASS_ID ? NULL : get_class(id);
+    }
+};
+
+//////////////////////////////////////////////////////////////////////
+// ClassTable类 - 语义分析器的核心数据结构
+//
+// 负责构建继承图并检查继承关系；构建完成后用freeze()得到只读的
+// FrozenClassTable，类型检查在快照上进行。
+//////////////////////////////////////////////////////////////////////
+
+class ClassTable : private FrozenClassTable {
+private:
+    Diagnostics diagnostics;               // 收集到的诊断信息
+    ExprTypes expr_types;                  // 推断的类型，按表达式编号
     
     // 基本类的成员变量（避免悬空指针）
     Class_ Object_class;
@@ -36,40 +560,46 @@ private:
     Class_ Bool_class;
     Class_ String_class;
     
+    // freeze()产生的快照，之前为空
+    std::shared_ptr<const FrozenClassTable> frozen;
+    
     // 私有方法
     void install_basic_classes();          // 安装基本类
+    void install_cached_classes();         // 从类摘要缓存安装库类
     void build_inheritance_graph(Classes classes); // 构建继承图
     void check_inheritance();              // 检查继承关系
+    void number_inheritance_tree();        // 对继承树进行区间编号
+    void build_lca_table();                // 构建LCA稀疏表
+    void build_method_tables();            // 自顶向下构建方法表
+    void build_attribute_layouts();        // 自顶向下构建属性布局
+    void index_expressions();              // 为所有特性中的表达式编号
     
-    // 类型检查方法
-    void type_check_class(Class_ c);       // 检查单个类
-    Symbol type_check_expression(Expression expr, 
-                                 Symbol current_class,
-                                 SymbolTable<Symbol, Symbol>* object_env,
-                                 const char* filename);
+    // 类编号管理
+    ClassId add_class(Class_ c, unsigned char flags); // 为有定义的类分配编号
+    ClassId intern_class(Symbol name);     // 取得类名的编号，没有则分配一个未定义的编号
+    void resolve_parents();                // 计算父类编号
+    int add_signature(method_class* method); // 计算并登记方法签名
     
-    // 辅助方法
-    bool is_subtype(Symbol child, Symbol parent);  // 检查子类型关系
-    Symbol lub(Symbol type1, Symbol type2);        // 计算最小上界
-    method_class* find_method(Symbol class_name, Symbol method_name); // 查找方法
+    // 错误报告（继承图构建阶段）
+    void semant_error(Class_ c, DiagCode code,
+                      DiagArg a0 = DiagArg(), DiagArg a1 = DiagArg(), DiagArg a2 = DiagArg());
     
 public:
-    // 构造函数
-    ClassTable(Classes classes);
+    // 构造函数；stats不为NULL时记录各构建阶段的耗时
+    ClassTable(Classes classes, SemantStats* stats = NULL);
     
-    // 公共方法
-    void type_check();                     // 执行类型检查
-    int errors() { return semant_errors; } // 获取错误数量
+    // 把构建好的数据移入只读快照；之后类表本身不再持有数据，
+    // 重复调用返回同一个快照
+    std::shared_ptr<const FrozenClassTable> freeze();
     
-    // 迭代器支持
-    typedef SymbolTable<Symbol, Class_>::iterator iterator;
-    iterator begin() { return class_table->begin(); }
-    iterator end() { return class_table->end(); }
+    // 公共方法
+    void type_check(int jobs, CheckerCounters* counters = NULL); // 冻结后用jobs个线程执行类型检查
+    int errors() { return diagnostics.count(); } // 获取错误数量
+    bool stopped() const { return diagnostics.stopped(); } // 是否因为--max-errors提前停止
+    const ExprTypes& inferred_types() const { return expr_types; } // 检查后按编号取推断的类型
     
-    // 类查找
-    Class_* get_class(Symbol name) {
-        return class_table->lookup(name);
-    }
+    // 排序、去重后把诊断信息一次写入out，返回写出的条数
+    int write_diagnostics(ostream& out, bool json) const { return diagnostics.write(out, json); }
     
     // 获取基本类的方法
     Class_ get_object_class() { return Object_class; }
@@ -79,4 +609,253 @@ public:
     Class_ get_string_class() { return String_class; }
 };
 
+//////////////////////////////////////////////////////////////////////
+// 带类型的AST输出
+//
+// 输出与dump_with_types逐字节相同，供编译器的下一阶段读入。文本写入
+// 若干大块缓冲区：缩进从预先准备好的空格中复制，行号和符号直接复制，
+// 不经过iostream的格式化；最后用writev一次写出所有块。遍历用显式栈，
+// 嵌套很深的表达式也不会耗尽调用栈。
+//
+// 给出检查通过时保留的CheckedProgram时，类和特性取自类表中扁平化的
+// 数组，表达式按编号遍历，类型从ExprTypes中按先序读出，不再重新遍历
+// append构成的列表。
+//////////////////////////////////////////////////////////////////////
+
+// 检查通过的程序：冻结的类表和按编号存放的推断类型
+struct CheckedProgram {
+    Classes classes;                       // 被检查的类列表，用来确认与要输出的程序一致
+    std::shared_ptr<const FrozenClassTable> table;
+    ExprTypes types;
+    
+    CheckedProgram() : classes(NULL) {}
+};
+
+class TypedAstWriter {
+private:
+    static const size_t CHUNK_SIZE = 1 << 20; // 每块缓冲区的大小
+    
+    struct Chunk {
+        std::unique_ptr<char[]> data;
+        size_t size;                       // 已经写入的字节数；最后一块以cursor为准
+    };
+    std::vector<Chunk> chunks;             // 按顺序存放的输出
+    char* cursor;                          // 最后一块中的写入位置
+    char* limit;                           // 最后一块的末尾
+    
+    // 待输出的一项：一个节点，或者节点之后的一行（符号、括号、类型）
+    enum Step {
+        STEP_CLASS,
+        STEP_FEATURE,
+        STEP_FORMAL,
+        STEP_CASE,
+        STEP_EXPRESSION,
+        STEP_SYMBOL,
+        STEP_TEXT,
+        STEP_TYPE
+    };
+    struct Item {
+        Step step;
+        int indent;
+        tree_node* node;                   // 节点；STEP_TYPE时为表达式，STEP_CASE时为分支
+        int id;                            // 有类表时的类编号、特性下标或表达式编号（分支为其表达式的编号），否则为-1
+        Symbol symbol;                     // STEP_SYMBOL时的符号
+        const char* text;                  // STEP_TEXT时的文本
+    };
+    std::vector<Item> pending;             // 显式栈，栈顶先输出
+    std::vector<Item> children;            // 当前表达式的子表达式，各节点之间复用
+    std::vector<Expression> child_exprs;
+    
+    const FrozenClassTable* table;         // 检查时的类表，NULL表示直接遍历AST
+    const ExprTypes* types;                // 与table对应的推断类型
+    
+    // 保证当前块至少还有n字节，返回写入位置；写完后用commit移动写入位置
+    char* reserve(size_t n) { return (size_t)(limit - cursor) >= n ? cursor : add_chunk(n); }
+    char* add_chunk(size_t n);
+    void commit(char* end) { cursor = end; }
+    size_t chunk_size(size_t k) const {
+        return k + 1 == chunks.size() ? cursor - chunks[k].data.get() : chunks[k].size;
+    }
+    
+    // 输出一行：缩进indent，然后是内容和换行
+    void put_text(int indent, const char* text, size_t len);
+    void put_symbol(int indent, Symbol symbol) { put_text(indent, symbol->get_string(), symbol->get_len()); }
+    void put_line_number(int indent, int line);            // "#行号"
+    void put_type(int indent, Symbol type);                // ": 类型"，没有类型时为": _no_type"
+    void put_string(int indent, const char* s);            // 带引号和转义的字符串常量
+    
+    // 把一项压入显式栈
+    void push(Step step, int indent, tree_node* node, int id = -1, Symbol symbol = NULL, const char* text = NULL);
+    template <class Elem>
+    void push_list(Step step, int indent, list_node<Elem>* list); // 逆序压入，使第一个元素先输出
+    
+    void write_class(const Item& item);
+    void write_feature(const Item& item);
+    void write_expression(const Item& item);
+    
+public:
+    TypedAstWriter() : cursor(NULL), limit(NULL), table(NULL), types(NULL) {}
+    
+    // 把program的带类型AST追加到缓冲区；checked是检查program时保留的结果，可以为NULL
+    void write(Program program, const CheckedProgram* checked = NULL);
+    size_t size() const;                   // 缓冲区中的字节数
+    void append_to(std::string& out) const; // 把缓冲区的内容追加到out
+    bool flush(int fd);                    // 用writev把缓冲区全部写到fd并清空，失败返回false
+};
+
+// 把program的带类型AST写到fd，输出与program->dump_with_types(cout, 0)相同；
+// program刚由program_class::semant检查过时直接使用检查的结果，写完后
+// 释放该结果。之前用cout输出过内容时应先cout.flush()
+bool dump_typed_ast(Program program, int fd);
+
+//////////////////////////////////////////////////////////////////////
+// ClassChecker - 类的类型检查器
+//
+// 检查在冻结的类表上进行，类表只被读取。检查一个类分两步：先按顺序
+// 检查属性并建立属性环境，再逐个检查方法；方法之间互不依赖，
+// 可以由不同线程的检查器同时进行，共享该类只读的属性环境。
+// 每个特性的诊断信息放在自己的槽位中，最后按类和特性的顺序合并，
+// 输出与串行检查完全相同。
+//////////////////////////////////////////////////////////////////////
+
+// 一个类的检查结果
+struct ClassCheckResult {
+    std::vector<Diagnostics> feature_diagnostics; // 每个特性的诊断信息，与类的特性一一对应
+    ObjectEnv attr_env;                      // self和本类属性，检查方法时作为外层环境
+    std::vector<std::vector<Symbol> > feature_uses; // 增量检查时每个特性查询过的类名
+};
+
+// 增量检查保留的类摘要
+struct ClassSummary {
+    uint64_t fingerprint;                    // 类内容的指纹
+    std::vector<std::pair<Symbol, uint64_t> > dependencies; // 查询过的类名及当时的接口指纹
+    std::vector<Diagnostics> feature_diagnostics; // 每个特性的诊断信息
+    std::vector<Symbol> types;               // 所有表达式的类型，按先序
+};
+
+class ClassChecker {
+private:
+    const FrozenClassTable& class_table;   // 只读的类表
+    const ExprIndex& index;                // 类表中的表达式编号
+    ExprTypes& types;                      // 推断的类型；不同检查器写不同的编号
+    Diagnostics diagnostics;               // 当前特性的诊断信息
+    ObjectEnv env_stack;                   // 方法的对象环境，检查不同的方法时复用
+    bool record_uses;                      // 是否记录查询过的类名（增量检查）
+    std::vector<Symbol> uses;              // 当前特性查询过的类名
+    std::atomic<int>* error_count;         // 各检查器共用的错误数，NULL表示不限制
+    std::atomic<bool>* stopped;            // 各检查器共用：有错误因为上限被丢弃
+    CheckerCounters counters;              // 统计计数
+    bool count_walks;                      // 是否计算父类链的长度（统计打开时）
+    
+    // 错误报告；达到--max-errors后不再记录，此后第一个被丢弃的错误
+    // 使所有检查器停止检查表达式
+    bool admit_error();
+    bool error_limit_reached() const;
+    void semant_error(Class_ c, DiagCode code,
+                      DiagArg a0 = DiagArg(), DiagArg a1 = DiagArg(), DiagArg a2 = DiagArg());
+    void semant_error(const char* filename, tree_node *t, DiagCode code,
+                      DiagArg a0 = DiagArg(), DiagArg a1 = DiagArg(),
+                      DiagArg a2 = DiagArg(), DiagArg a3 = DiagArg());
+    void finish_feature(ClassCheckResult& result, int k); // 把诊断信息移入第k个特性的槽位
+    
+    // 显式栈上的一帧：一个正在检查的表达式和检查到哪一步
+    struct ExprFrame {
+        NodeId id;
+        Expression expr;
+        ExprKind kind;
+        int stage;                         // 已经完成的步骤，0表示刚开始
+        NodeId child;                      // 下一个子表达式的编号
+        NodeId end;                        // 子树之后的第一个编号，child到此为止
+        int param_index;                   // 正在检查的参数序号
+        Symbol type;                       // 已经得到的中间类型（变量类型、then分支类型等）
+        Symbol original_type;              // 分派接收者解析SELF_TYPE前的类型
+        const MethodSignature* signature;  // 分派找到的方法
+    };
+    std::vector<ExprFrame> expr_stack;     // 表达式检查的工作栈，在堆上，各表达式之间复用
+    
+    // 类型检查方法；不递归，嵌套深度只受内存限制
+    Symbol type_check_expression(NodeId root,
+                                 Symbol current_class,
+                                 ObjectEnv* object_env,
+                                 const char* filename);
+    bool enter_expression(NodeId id, Symbol& result); // 压入一帧；不需要检查时返回false并给出类型
+    
+    // 类表查询；增量检查时记录查询过的类名，作为本类的依赖
+    void use(Symbol name) { if (record_uses) uses.push_back(name); }
+    bool is_defined(Symbol name) { use(name); return class_table.is_defined(name); }
+    bool is_subtype(Symbol child, Symbol parent) {
+        use(child);
+        use(parent);
+        counters.subtype_checks++;
+        if (count_walks) counters.chain_walk_steps += class_table.chain_walk_length(child, parent);
+        return class_table.is_subtype(child, parent);
+    }
+    Symbol lub(Symbol type1, Symbol type2) {
+        use(type1);
+        use(type2);
+        counters.lub_calls++;
+        return class_table.lub(type1, type2);
+    }
+    const MethodSignature* find_signature(Symbol class_name, Symbol method_name) {
+        use(class_name);
+        counters.method_lookups++;
+        return class_table.find_signature(class_name, method_name);
+    }
+    const MethodSignature* find_signature(ClassId class_id, Symbol method_name) {
+        use(class_table.class_names[class_id]);
+        counters.method_lookups++;
+        return class_table.find_signature(class_id, method_name);
+    }
+    Symbol signature_formal(const MethodSignature* signature, int k) const {
+        return class_table.signature_formal(signature, k);
+    }
+    
+public:
+    ClassChecker(const FrozenClassTable& table, ExprTypes& types, bool record_uses = false,
+                 std::atomic<int>* error_count = NULL, std::atomic<bool>* stopped = NULL,
+                 bool count_walks = false);
+    
+    void check_attributes(ClassId id, ClassCheckResult& result);      // 检查属性，建立属性环境
+    void check_method(ClassId id, int feature, ClassCheckResult& result); // 检查一个方法（class_features下标）
+    void type_check_class(ClassId id, ClassCheckResult& result);      // 依次完成以上两步
+    void add_counters(CheckerCounters& total) const;                  // 把本检查器的计数累加到total
+};
+
+//////////////////////////////////////////////////////////////////////
+// TaskPool - 工作窃取线程池
+//
+// 每个工作线程有自己的任务队列，从队尾取任务；自己的队列为空时
+// 从其他线程队列的队首窃取。任务执行中可以继续放入新任务，
+// 所有任务（包括新放入的）完成后run返回。没有任务可取的线程在条件
+// 变量上等待，不占用处理器。
+//////////////////////////////////////////////////////////////////////
+
+class TaskPool {
+public:
+    typedef std::function<void(int worker)> Task; // 参数为执行任务的线程编号
+    
+private:
+    struct Queue {
+        std::mutex lock;
+        std::deque<Task> tasks;
+    };
+    
+    std::vector<Queue> queues;             // 每个工作线程一个队列
+    std::atomic<int> pending;              // 已放入但尚未完成的任务数
+    std::atomic<int> queued;               // 还在队列中、尚未被取走的任务数
+    std::mutex idle_lock;                  // 与idle一起使用
+    std::condition_variable idle;          // 放入任务或全部任务完成时通知空闲的线程
+    
+    bool take(int worker, Task& task);     // 取自己的任务或窃取别人的任务
+    void wake_idle(bool all);              // 唤醒一个（新任务）或全部（任务完成）空闲的线程
+    void work(int worker);                 // 工作线程主循环
+    
+public:
+    TaskPool(int workers);
+    
+    int workers() const { return queues.size(); }
+    void push(int worker, const Task& task); // 放入worker的队列
+    void run();                            // 启动工作线程并等待所有任务完成
+};
+
 #endif /* SEMANT_H_ */